@@ -29,12 +29,18 @@
  *
  */
 
+#include <stdio.h>
 #include <errno.h>
 
 #include "vfs.h"
 #include "vfsnode.h"
 #include "backends.h"
 
+#ifdef HOST
+#include "host.h"
+#define syscall_info_flash host_flash_info
+#define syscall_read_flash host_flash_read
+#else
 static int syscall_info_flash(int sect, int *info)
 {
   return (*(int (**)())0x8c0000b8)(sect,info,0,0);  
@@ -44,14 +50,18 @@ static int syscall_read_flash(int offs, void *buf, int cnt)
 {
   return (*(int (**)())0x8c0000b8)(offs,buf,cnt,1);
 }
+#endif
 
 typedef struct flashnode_private_s {
   int offs, len;
 } flashnode_private_t;
 
+/* The flash syscall has a fair amount of overhead per call */
+#define FLASH_BLKSIZE 8192
+
 static void flashnode_init(vfsnode_t *node, void *context)
 {
-  flashnode_private_t *private = calloc(1, sizeof(flashnode_private_t));
+  flashnode_private_t *private = vfsnode_alloc(node, sizeof(flashnode_private_t));
   if (private) {
     private->offs = ((const int *)context)[0];
     private->len = ((const int *)context)[1];
@@ -64,6 +74,8 @@ static int flashnode_stat(vfsnode_t *node, const char *path, vfs_stat_t *st)
   flashnode_private_t *private = (flashnode_private_t *)node->private;
   if (private) {
     st->st_size = private->len;
+    st->st_blksize = FLASH_BLKSIZE;
+    return 0;
   } else
     return -ENOENT;
 }
@@ -99,11 +111,22 @@ static int flashnode_read(vfsnode_t *node, vfs_file_t *file, void *buffer,
     return 0;
 }
 
+static int flashnode_seek(vfsnode_t *node, vfs_file_t *file,
+			  unsigned long offset)
+{
+  flashnode_private_t *private = (flashnode_private_t *)node->private;
+  if (!private || offset > private->len)
+    return -EINVAL;
+  file->posn = offset;
+  return 0;
+}
+
 static vfsnode_vtable_t flashnode_vtable = {
   .init = flashnode_init,
   .stat = flashnode_stat,
   .open = flashnode_open,
   .read = flashnode_read,
+  .seek = flashnode_seek,
 };
 
 void flash_be_init(void)
@@ -120,6 +143,16 @@ void flash_be_init(void)
 	vfsnode_mknode(root, buf, &flashnode_vtable, info);
       }
   }
-  vfsnode_mkromnode(NULL, "rom", (const void *)0xa0000000, 2*1024*1024);
+#ifdef HOST
+  {
+    size_t size;
+    const void *rom = host_rom(&size);
+    if (rom)
+      vfsnode_mkromnode(NULL, "rom", rom, size);
+  }
+#else
+  /* Use the cached P1 alias, the ROM never changes under us */
+  vfsnode_mkromnode(NULL, "rom", (const void *)0x80000000, 2*1024*1024);
+#endif
   vfs_unlock();
 }
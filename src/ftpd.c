@@ -38,10 +38,12 @@
 #include "ftpd.h"
 
 #include "lwip/tcp.h"
+#include "lwip/sys.h"
 
 #include <stdio.h>
 #include <stdarg.h>
 #include <malloc.h>
+#include <stdlib.h>
 #ifdef _WIN32
 #include <string.h>
 #endif
@@ -50,6 +52,10 @@
 #include <time.h>
 
 #include "vfs.h"
+#include "pool.h"
+#include "stats.h"
+#include "trace.h"
+#include "heap.h"
 
 #ifdef FTPD_DEBUG
 int dbg_printf(const char *fmt, ...);
@@ -77,10 +83,16 @@ int dbg_printf(const char *fmt, ...);
 #define msg150recv "150 Opening BINARY mode data connection for %s (%i bytes)."
 #define msg150stor "150 Opening BINARY mode data connection for %s."
 #define msg200 "200 Command okay."
+#define msg200TRACE "200 Tracing %s, %d events recorded."
 #define msg202 "202 Command not implemented, superfluous at this site."
 #define msg211 "211 System status, or system help reply."
+#define msg211STAT "211-Status of ftpd:"
+#define msg211STATEND "211 End of status."
+#define msg211FEAT "211-Features:"
+#define msg211END "211 End"
 #define msg212 "212 Directory status."
 #define msg213 "213 File status."
+#define msg213SIZE "213 %lu"
 #define msg214 "214 %s."
 /*
 	     214 Help message.
@@ -113,8 +125,11 @@ int dbg_printf(const char *fmt, ...);
 /*
 	 227 Entering Passive Mode (h1,h2,h3,h4,p1,p2).
 */
+#define msg229 "229 Entering Extended Passive Mode (|||%u|)."
 #define msg230 "230 User logged in, proceed."
 #define msg250 "250 Requested file action okay, completed."
+#define msg250MLST "250-Listing %s"
+#define msg250END "250 End"
 #define msg257PWD "257 \"%s\" is current directory."
 #define msg257 "257 \"%s\" created."
 /*
@@ -123,6 +138,9 @@ int dbg_printf(const char *fmt, ...);
 #define msg331 "331 User name okay, need password."
 #define msg332 "332 Need account for login."
 #define msg350 "350 Requested file action pending further information."
+#define msg350REST "350 Restarting at %lu. Send STORE or RETRIEVE to initiate transfer."
+#define msg350RANG "350 Restarting at %lu. Ending at %lu."
+#define msg350RANGEOF "350 Restarting at 0. Ending at EOF."
 #define msg421 "421 Service not available, closing control connection."
 /*
 	     This may be a reply to any command if the service knows it
@@ -147,6 +165,7 @@ int dbg_printf(const char *fmt, ...);
 #define msg502 "502 Command not implemented."
 #define msg503 "503 Bad sequence of commands."
 #define msg504 "504 Command not implemented for that parameter."
+#define msg522 "522 Network protocol not supported, use (1)."
 #define msg530 "530 Not logged in."
 #define msg532 "532 Need account for storing files."
 #define msg550 "550 Requested action not taken."
@@ -163,6 +182,7 @@ int dbg_printf(const char *fmt, ...);
 /*
 	     File name not allowed.
 */
+#define msg554 "554 Requested action not taken: invalid REST parameter."
 
 enum ftpd_state_e {
 	FTPD_USER,
@@ -170,6 +190,7 @@ enum ftpd_state_e {
 	FTPD_IDLE,
 	FTPD_NLST,
 	FTPD_LIST,
+	FTPD_MLSD,
 	FTPD_RETR,
 	FTPD_RNFR,
 	FTPD_STOR,
@@ -191,6 +212,53 @@ static const char *month_table[12] = {
 	"Dez"
 };
 
+/* The host build listens elsewhere, as 21 needs privileges there */
+#ifndef FTPD_PORT
+#define FTPD_PORT 21
+#endif
+
+/*
+ * Sessions, data connections and their FIFO buffers are taken from
+ * pools, see pool.c.  All FIFOs start out small; a data FIFO that is
+ * grown for a fast connection takes a buffer from the large pool.
+ */
+#ifndef FTPD_SESSION_POOL
+#define FTPD_SESSION_POOL 8
+#endif
+#ifndef FTPD_DATA_POOL
+#define FTPD_DATA_POOL 8
+#endif
+#ifndef FTPD_BIGFIFO_POOL
+#define FTPD_BIGFIFO_POOL 2
+#endif
+#define FTPD_FIFO_SIZE 2048
+
+static pool_t session_pool, data_pool, fifo_pool, bigfifo_pool;
+
+/* Counters for /stats/ftpd, only touched from the tcpip thread */
+static struct {
+	unsigned long sessions, sessions_total, transfers;
+	unsigned long long bytes_sent;
+	unsigned long fifo_stalls, msgpoll_wakeups, msgpoll_busy;
+} ftpd_stats;
+
+static void *fifo_alloc(int size)
+{
+	if (size <= fifo_pool.size)
+		return pool_alloc(&fifo_pool);
+	if (size <= bigfifo_pool.size)
+		return pool_alloc(&bigfifo_pool);
+	return heap_alloc(HEAP_FTPD, size);
+}
+
+static void fifo_free(void *buffer)
+{
+	if (pool_owns(&bigfifo_pool, buffer))
+		pool_free(&bigfifo_pool, buffer);
+	else
+		pool_free(&fifo_pool, buffer);
+}
+
 /*
 ------------------------------------------------------------
 	SFIFO 1.3
@@ -278,7 +346,7 @@ static int sfifo_init(sfifo_t *f, int size)
 		;
 
 	/* Get buffer */
-	if( 0 == (f->buffer = (void *)malloc(f->size)) )
+	if( 0 == (f->buffer = fifo_alloc(f->size)) )
 		return -ENOMEM;
 
 	return 0;
@@ -290,7 +358,7 @@ static int sfifo_init(sfifo_t *f, int size)
 static void sfifo_close(sfifo_t *f)
 {
 	if(f->buffer)
-		free(f->buffer);
+		fifo_free(f->buffer);
 }
 
 /*
@@ -373,16 +441,49 @@ static int sfifo_read(sfifo_t *f, void *_buf, int len)
 	return total;
 }
 
+/*
+ * Limits for the per-connection data buffer.  The actual size is picked
+ * from the amount of data the TCP connection can keep in flight once it
+ * has been established.
+ */
+#ifndef FTPD_DATA_BUFSIZE_MIN
+#define FTPD_DATA_BUFSIZE_MIN 2048
+#endif
+#ifndef FTPD_DATA_BUFSIZE_MAX
+#define FTPD_DATA_BUFSIZE_MAX 32768
+#endif
+/* Largest block that is read through a bounce buffer at the FIFO wrap */
+#define FTPD_BOUNCE_SIZE 2352
+
+struct ftpd_listing;
+
 struct ftpd_datastate {
 	int connected, sending;
-	vfs_dir_t *vfs_dir;
-	vfs_dirent_t *vfs_dirent;
+	int lowat, hiwat;
+	int blksize;
+	unsigned long posn, left;
+	struct ftpd_listing *listing;
 	vfs_file_t *vfs_file;
+	int map_tried;
+	const char *map_ptr;
+	unsigned long map_left, inflight;
+	unsigned long stall_start, sent_start;
+	/* Waiting for the backend, see ftpd_datastall() */
+	int stalled, notified;
+	struct ftpd_datastate *stall_next;
+	/* Progress, for STAT */
+	char *name;
+	unsigned long total, sent, rate;
+	unsigned long sample_clock, sample_sent;
+	time_t started;
 	sfifo_t fifo;
 	struct tcp_pcb *msgpcb;
 	struct ftpd_msgstate *msgfs;
 };
 
+/* Longest command line accepted, including the terminator */
+#define FTPD_LINE_MAX 512
+
 struct ftpd_msgstate {
 	enum ftpd_state_e state;
 	sfifo_t fifo;
@@ -391,11 +492,137 @@ struct ftpd_msgstate {
 	u16_t dataport;
 	struct tcp_pcb *datapcb;
 	struct ftpd_datastate *datafs;
-	int passive, sending;
+	int passive, sending, epsv_all;
+	struct ftpd_pasvslot *pasv;
 	char *renamefrom;
+	unsigned long rest, rang_end;
+	int rang;
+	/* Received but not yet processed, starting rxoff bytes in */
+	struct pbuf *rxq;
+	u16_t rxoff;
+	/* Command being assembled; linedone once it is complete */
+	char line[FTPD_LINE_MAX];
+	int linelen, linedone, linebad, processing;
 };
 
 static void send_msg(struct tcp_pcb *pcb, struct ftpd_msgstate *fsm, char *msg, ...);
+static void ftpd_msgprocess(struct tcp_pcb *pcb, struct ftpd_msgstate *fsm);
+
+/*
+ * Rendered directory listings, kept for reuse until the VFS tree
+ * changes.  Listings of generated files are not kept, as their sizes
+ * change without the tree changing.  An entry is freed when the last
+ * transfer sending it and the cache itself have let go of it.
+ */
+#ifndef FTPD_LISTCACHE_ENTRIES
+#define FTPD_LISTCACHE_ENTRIES 8
+#endif
+
+enum ftpd_listfmt {
+	LISTFMT_LONG,		/* LIST */
+	LISTFMT_NAMES,		/* NLST */
+	LISTFMT_FACTS		/* MLSD */
+};
+
+struct ftpd_listing {
+	struct ftpd_listing *next;
+	int refs;
+	char *path;
+	enum ftpd_listfmt format;
+	int year;
+	unsigned long gen;
+	int uncacheable;	/* Has entries that change by themselves */
+	char *data;
+	int len, size;
+};
+
+static struct ftpd_listing *listcache = NULL;
+
+static void listing_put(struct ftpd_listing *l)
+{
+	if (--l->refs == 0) {
+		heap_free(l->path);
+		heap_free(l->data);
+		heap_free(l);
+	}
+}
+
+static struct ftpd_listing *listing_lookup(const char *path, enum ftpd_listfmt format, int year)
+{
+	struct ftpd_listing **pp, *l;
+	unsigned long gen = vfs_generation();
+
+	for (pp = &listcache; (l = *pp) != NULL;) {
+		if (l->gen != gen) {
+			*pp = l->next;
+			listing_put(l);
+			continue;
+		}
+		if (l->format == format && l->year == year &&
+		    !strcmp(l->path, path)) {
+			/* Move to the front */
+			*pp = l->next;
+			l->next = listcache;
+			listcache = l;
+			l->refs++;
+			return l;
+		}
+		pp = &l->next;
+	}
+	return NULL;
+}
+
+static void listing_insert(struct ftpd_listing *l)
+{
+	struct ftpd_listing **pp;
+	int n;
+
+	l->refs++;
+	l->next = listcache;
+	listcache = l;
+	for (pp = &listcache, n = 0; *pp && n < FTPD_LISTCACHE_ENTRIES; n++)
+		pp = &(*pp)->next;
+	while (*pp) {
+		struct ftpd_listing *old = *pp;
+		*pp = old->next;
+		listing_put(old);
+	}
+}
+
+/*
+ * Transfers waiting for the backend to have more data.  The backend's
+ * notify runs in its own thread and only sets notified; ftpd_wakepoll()
+ * resumes the transfer from the lwIP thread.
+ */
+#define FTPD_WAKEPOLL_INTERVAL 2
+
+static struct ftpd_datastate *stalled = NULL;
+
+static void ftpd_unstall(struct ftpd_datastate *fsd)
+{
+	struct ftpd_datastate **pp;
+
+	if (!fsd->stalled)
+		return;
+	for (pp = &stalled; *pp; pp = &(*pp)->stall_next)
+		if (*pp == fsd) {
+			*pp = fsd->stall_next;
+			break;
+		}
+	fsd->stalled = 0;
+}
+
+static void ftpd_datafree(struct ftpd_datastate *fsd)
+{
+	ftpd_unstall(fsd);
+	if (fsd->vfs_file)
+		vfs_close(fsd->vfs_file);
+	if (fsd->listing)
+		listing_put(fsd->listing);
+	heap_free(fsd->name);
+	sfifo_close(&fsd->fifo);
+	pool_free(&data_pool, fsd);
+}
 
 static void ftpd_dataerr(void *arg, err_t err)
 {
@@ -406,30 +633,100 @@ static void ftpd_dataerr(void *arg, err_t err)
 		return;
 	fsd->msgfs->datafs = NULL;
 	fsd->msgfs->state = FTPD_IDLE;
-	free(fsd);
+	ftpd_datafree(fsd);
 }
 
 static void ftpd_dataclose(struct tcp_pcb *pcb, struct ftpd_datastate *fsd)
 {
+	int inflight = (fsd->inflight > 0);
+
 	tcp_arg(pcb, NULL);
 	tcp_sent(pcb, NULL);
 	tcp_recv(pcb, NULL);
 	fsd->msgfs->datafs = NULL;
-	sfifo_close(&fsd->fifo);
-	free(fsd);
+	ftpd_datafree(fsd);
 	tcp_arg(pcb, NULL);
-	tcp_close(pcb);
+	/* Segments queued without copying must not outlive their data */
+	if (inflight)
+		tcp_abort(pcb);
+	else
+		tcp_close(pcb);
 }
 
-static void send_data(struct tcp_pcb *pcb, struct ftpd_datastate *fsd)
+/*
+ * Give up on a transfer that cannot be completed.  The connection is
+ * reset rather than closed, so that the client does not take what it
+ * got for the whole file either.
+ */
+static void ftpd_datafail(struct tcp_pcb *pcb, struct ftpd_datastate *fsd)
+{
+	struct ftpd_msgstate *fsm = fsd->msgfs;
+	struct tcp_pcb *msgpcb = fsd->msgpcb;
+
+	tcp_arg(pcb, NULL);
+	tcp_sent(pcb, NULL);
+	tcp_recv(pcb, NULL);
+	tcp_err(pcb, NULL);
+	fsm->datapcb = NULL;
+	fsm->datafs = NULL;
+	ftpd_datafree(fsd);
+	tcp_abort(pcb);
+	fsm->state = FTPD_IDLE;
+	send_msg(msgpcb, fsm, msg451);
+	ftpd_msgprocess(msgpcb, fsm);
+}
+
+/*
+ * Size the data buffer once the connection is up.  lwIP never keeps
+ * more than min(snd_wnd, TCP_SND_BUF) bytes in flight, so that is the
+ * bandwidth-delay product the connection can use.  Twice that lets one
+ * window drain while the next one is read in.
+ */
+static void size_data_fifo(struct ftpd_datastate *fsd, struct tcp_pcb *pcb)
+{
+	int bdp, size;
+
+	bdp = pcb->snd_wnd;
+	if (bdp > TCP_SND_BUF)
+		bdp = TCP_SND_BUF;
+	size = 2 * bdp;
+	if (size < 4 * fsd->blksize)
+		size = 4 * fsd->blksize;
+	if (size < FTPD_DATA_BUFSIZE_MIN)
+		size = FTPD_DATA_BUFSIZE_MIN;
+	if (size > FTPD_DATA_BUFSIZE_MAX)
+		size = FTPD_DATA_BUFSIZE_MAX;
+
+	if (size > fsd->fifo.size && sfifo_used(&fsd->fifo) == 0) {
+		sfifo_t fifo;
+		if (sfifo_init(&fifo, size - 1) == 0) {
+			sfifo_close(&fsd->fifo);
+			fsd->fifo = fifo;
+		}
+	}
+
+	fsd->hiwat = fsd->fifo.size - 1;
+	fsd->lowat = (bdp < fsd->hiwat / 2 ? bdp : fsd->hiwat / 2);
+	if (fsd->blksize > fsd->hiwat / 2)
+		fsd->blksize = 0;
+}
+
+/*
+ * Queue as much of the FIFO as the send buffer takes.
+ * Returns the number of bytes handed to TCP.
+ */
+static int send_data(struct tcp_pcb *pcb, struct ftpd_datastate *fsd)
 {
 	err_t err;
 	u16_t len;
+	int total = 0;
+	unsigned long t;
 
 	/* This function is not reentrant */
 	if (fsd->sending)
-		return;
+		return 0;
 	fsd->sending = 1;
+	t = trace_begin();
 
 	if (sfifo_used(&fsd->fifo) > 0 && tcp_sndbuf(pcb) > 15) {
 		int i;
@@ -442,15 +739,20 @@ static void send_data(struct tcp_pcb *pcb, struct ftpd_datastate *fsd)
 			len = (u16_t) sfifo_used(&fsd->fifo);
 		}
 
+		/* Keep to whole segments while there is more file data to come */
+		if (fsd->vfs_file && len > pcb->mss)
+			len -= len % pcb->mss;
+
 		i = fsd->fifo.readpos;
 		if ((i + len) > fsd->fifo.size) {
 			err = tcp_write(pcb, fsd->fifo.buffer + i, (u16_t)(fsd->fifo.size - i), 1);
 			if (err != ERR_OK) {
 				dbg_printf("send_data: error writing!\n");
 				fsd->sending = 0;
-				return;
+				return total;
 			}
 			len -= fsd->fifo.size - i;
+			total += fsd->fifo.size - i;
 			fsd->fifo.readpos = 0;
 			i = 0;
 		}
@@ -459,138 +761,364 @@ static void send_data(struct tcp_pcb *pcb, struct ftpd_datastate *fsd)
 		if (err != ERR_OK) {
 			dbg_printf("send_data: error writing!\n");
 			fsd->sending = 0;
-			return;
+			return total;
 		}
-		fsd->fifo.readpos += len;
+		fsd->fifo.readpos = (i + len) & SFIFO_SIZEMASK(&fsd->fifo);
+		total += len;
 	}
 
+	if (total > 0) {
+		trace_end("send_data", TRACE_FTPD, t, total);
+		if (!fsd->sent_start)
+			fsd->sent_start = trace_begin();
+	}
 	fsd->sending = 0;
+	return total;
+}
+
+/*
+ * Read file data straight into the FIFO until it reaches the high
+ * watermark.  Reads are whole multiples of the file's preferred block
+ * size and end on a block boundary.  Returns the number of bytes read,
+ * or the result of the failing vfs_read() if nothing could be read.
+ */
+static int fill_fifo(struct ftpd_datastate *fsd)
+{
+	sfifo_t *f = &fsd->fifo;
+	int blk = (fsd->blksize > 1 ? fsd->blksize : 1);
+	int total = 0;
+
+	f->writepos &= SFIFO_SIZEMASK(f);
+	while (sfifo_used(f) < fsd->hiwat) {
+		char bounce[FTPD_BOUNCE_SIZE];
+		char *dst = f->buffer + f->writepos;
+		int room = fsd->hiwat - sfifo_used(f);
+		int contig = f->size - f->writepos;
+		/* Bytes up to the next block boundary */
+		int head = blk - fsd->posn % blk;
+		int len;
+
+		if (room > fsd->left)
+			room = fsd->left;
+		if (head > fsd->left)
+			head = fsd->left;
+		if (room == 0 || room < head)
+			break;
+		len = room - (room - head) % blk;
+		if (len > contig) {
+			if (contig >= head)
+				len = contig - (contig - head) % blk;
+			else if (head <= FTPD_BOUNCE_SIZE) {
+				/* Don't let the FIFO wrap split a block */
+				dst = bounce;
+				len = head;
+			} else
+				len = contig;
+		}
+		len = vfs_read(dst, 1, len, fsd->vfs_file);
+		if (len <= 0)
+			return (total ? total : len);
+		if (dst == bounce)
+			sfifo_write(f, bounce, len);
+		else
+			f->writepos += len;
+		f->writepos &= SFIFO_SIZEMASK(f);
+		fsd->posn += len;
+		fsd->left -= len;
+		total += len;
+	}
+	return total;
+}
+
+/*
+ * Queue file data straight from a mapped node, without copying it.
+ * lwIP references the memory until the segments are acked, so the
+ * file is kept open until fsd->inflight has dropped to zero.
+ */
+static void send_mapped(struct tcp_pcb *pcb, struct ftpd_datastate *fsd)
+{
+	err_t err;
+	u16_t len;
+
+	/* This function is not reentrant */
+	if (fsd->sending)
+		return;
+	fsd->sending = 1;
+
+	while (fsd->map_left > 0 && tcp_sndbuf(pcb) > 0) {
+		len = tcp_sndbuf(pcb);
+		if (fsd->map_left < len)
+			len = (u16_t) fsd->map_left;
+
+		err = tcp_write(pcb, fsd->map_ptr, len, 0);
+		if (err != ERR_OK) {
+			dbg_printf("send_mapped: error writing!\n");
+			break;
+		}
+		fsd->map_ptr += len;
+		fsd->map_left -= len;
+		fsd->inflight += len;
+		if (!fsd->sent_start)
+			fsd->sent_start = trace_begin();
+	}
+
+	fsd->sending = 0;
+}
+
+static void ftpd_wakepoll(void *arg);
+
+static void ftpd_datastall(struct ftpd_datastate *fsd)
+{
+	if (fsd->stalled)
+		return;
+	if (!stalled)
+		sys_timeout(FTPD_WAKEPOLL_INTERVAL, ftpd_wakepoll, NULL);
+	fsd->stall_next = stalled;
+	stalled = fsd;
+	fsd->stalled = 1;
 }
 
 static void send_file(struct ftpd_datastate *fsd, struct tcp_pcb *pcb)
 {
+	struct ftpd_msgstate *fsm;
+	struct tcp_pcb *msgpcb;
+
 	if (!fsd->connected)
 		return;
 
-	if (fsd->vfs_file) {
-		char buffer[2048];
+	if (fsd->vfs_file && !fsd->map_tried) {
+		const void *ptr;
 		int len;
 
-		len = sfifo_space(&fsd->fifo);
-		if (len == 0) {
-			send_data(pcb, fsd);
-			return;
+		fsd->map_tried = 1;
+		len = vfs_map(&ptr, fsd->left, fsd->vfs_file);
+		if (len > 0) {
+			fsd->map_ptr = ptr;
+			fsd->map_left = len;
 		}
-		if (len > 2048)
-			len = 2048;
-		len = vfs_read(buffer, 1, len, fsd->vfs_file);
-		if (len == 0) {
-			if (vfs_eof(fsd->vfs_file) == 0)
-				return;
-			vfs_close(fsd->vfs_file);
-			fsd->vfs_file = NULL;
-			return;
-		}
-		sfifo_write(&fsd->fifo, buffer, len);
-		send_data(pcb, fsd);
-	} else {
-		struct ftpd_msgstate *fsm;
-		struct tcp_pcb *msgpcb;
+	}
 
-		if (sfifo_used(&fsd->fifo) > 0) {
-			send_data(pcb, fsd);
+	if (fsd->vfs_file && fsd->map_ptr) {
+		send_mapped(pcb, fsd);
+		if (fsd->map_left > 0 || fsd->inflight > 0)
 			return;
-		}
-		fsm = fsd->msgfs;
-		msgpcb = fsd->msgpcb;
-
 		vfs_close(fsd->vfs_file);
 		fsd->vfs_file = NULL;
-		ftpd_dataclose(pcb, fsd);
-		fsm->datapcb = NULL;
-		fsm->datafs = NULL;
-		fsm->state = FTPD_IDLE;
-		send_msg(msgpcb, fsm, msg226);
+	}
+
+	if (fsd->vfs_file) {
+		/* Keep refilling until the send buffer is full */
+		for (;;) {
+			if (fsd->vfs_file && sfifo_used(&fsd->fifo) < fsd->lowat) {
+				int len = fill_fifo(fsd);
+				/* Nothing left to send until the backend has read more */
+				if (len == -EAGAIN && sfifo_used(&fsd->fifo) == 0) {
+					ftpd_stats.fifo_stalls++;
+					if (!fsd->stall_start)
+						fsd->stall_start = trace_begin();
+					ftpd_datastall(fsd);
+				}
+				if ((len < 0 && len != -EAGAIN) || (len == 0 &&
+				    (fsd->left == 0 || vfs_eof(fsd->vfs_file)))) {
+					/* A read error, or the file ended early */
+					if (len < 0 || fsd->left != 0) {
+						ftpd_datafail(pcb, fsd);
+						return;
+					}
+					vfs_close(fsd->vfs_file);
+					fsd->vfs_file = NULL;
+				}
+			}
+			if (send_data(pcb, fsd) == 0)
+				break;
+		}
+		if (fsd->vfs_file)
+			return;
+	}
+
+	if (sfifo_used(&fsd->fifo) > 0) {
+		send_data(pcb, fsd);
 		return;
 	}
+	fsm = fsd->msgfs;
+	msgpcb = fsd->msgpcb;
+
+	ftpd_dataclose(pcb, fsd);
+	fsm->datapcb = NULL;
+	fsm->datafs = NULL;
+	fsm->state = FTPD_IDLE;
+	ftpd_stats.transfers++;
+	send_msg(msgpcb, fsm, msg226);
+	ftpd_msgprocess(msgpcb, fsm);
+}
+
+/*
+ * Called by the VFS, from the backend's thread and with the VFS lock
+ * held, when a read that returned -EAGAIN can be retried.
+ */
+static void ftpd_datanotify(void *arg)
+{
+	struct ftpd_datastate *fsd = arg;
+
+	fsd->notified = 1;
 }
 
-static void send_next_directory(struct ftpd_datastate *fsd, struct tcp_pcb *pcb, int shortlist)
+static void ftpd_wakepoll(void *arg)
 {
-	char buffer[1024];
+	struct ftpd_datastate **pp = &stalled, *fsd;
+
+	while ((fsd = *pp) != NULL) {
+		struct ftpd_msgstate *fsm = fsd->msgfs;
+		struct tcp_pcb *pcb = fsm->datapcb;
+
+		if (!fsd->notified) {
+			pp = &fsd->stall_next;
+			continue;
+		}
+		*pp = fsd->stall_next;
+		fsd->stalled = 0;
+		fsd->notified = 0;
+		if (fsd->msgfs->state != FTPD_RETR || !fsd->connected || !pcb)
+			continue;
+		if (fsd->stall_start) {
+			trace_end("fifo_stall", TRACE_FTPD, fsd->stall_start, 0);
+			fsd->stall_start = 0;
+		}
+		send_file(fsd, pcb);
+		/* The transfer may have ended, and pcb with it */
+		if (fsm->datapcb == pcb && pcb->unsent && !pcb->unacked)
+			tcp_output(pcb);
+		/* send_file() may have changed the list */
+		pp = &stalled;
+	}
+	if (stalled)
+		sys_timeout(FTPD_WAKEPOLL_INTERVAL, ftpd_wakepoll, NULL);
+}
+
+/*
+ * RFC 3659 facts for MLSD and MLST, terminated by the "; " that
+ * goes before the name.
+ */
+static int format_facts(char *buffer, const vfs_stat_t *st)
+{
+	struct tm *s_time = gmtime(&st->st_mtime);
+
+	return sprintf(buffer, "type=%s;size=%lu;modify=%04i%02i%02i%02i%02i%02i;unique=%lx; ",
+		       (VFS_ISDIR(st->st_mode) ? "dir" : "file"),
+		       (unsigned long)st->st_size, s_time->tm_year + 1900,
+		       s_time->tm_mon + 1, s_time->tm_mday, s_time->tm_hour,
+		       s_time->tm_min, s_time->tm_sec, st->st_ino);
+}
+
+/*
+ * Format one listing line into buffer, which must be large enough
+ * for the name plus 128 bytes.
+ */
+static int format_dirent(char *buffer, vfs_dirent_t *de, enum ftpd_listfmt format, int year)
+{
+	const vfs_stat_t *st = &de->st;
+	struct tm *s_time;
 	int len;
 
-	while (1) {
-	if (fsd->vfs_dirent == NULL)
-		fsd->vfs_dirent = vfs_readdir(fsd->vfs_dir);
+	if (format == LISTFMT_NAMES)
+		return sprintf(buffer, "%s\r\n", de->name);
+	if (format == LISTFMT_FACTS) {
+		len = format_facts(buffer, st);
+		return len + sprintf(buffer + len, "%s\r\n", de->name);
+	}
 
-	if (fsd->vfs_dirent) {
-		if (shortlist) {
-			len = sprintf(buffer, "%s\r\n", fsd->vfs_dirent->name);
-			if (sfifo_space(&fsd->fifo) < len) {
-				send_data(pcb, fsd);
-				return;
-			}
-			sfifo_write(&fsd->fifo, buffer, len);
-			fsd->vfs_dirent = NULL;
-		} else {
-			vfs_stat_t st;
-			time_t current_time;
-			int current_year;
-			struct tm *s_time;
-
-			time(&current_time);
-			s_time = gmtime(&current_time);
-			current_year = s_time->tm_year;
-
-			vfs_stat(fsd->msgfs->vfs, fsd->vfs_dirent->name, &st);
-			s_time = gmtime(&st.st_mtime);
-			if (s_time->tm_year == current_year)
-				len = sprintf(buffer, "-rw-rw-rw-   1 user     ftp  %11ld %s %02i %02i:%02i %s\r\n", st.st_size, month_table[s_time->tm_mon], s_time->tm_mday, s_time->tm_hour, s_time->tm_min, fsd->vfs_dirent->name);
-			else
-				len = sprintf(buffer, "-rw-rw-rw-   1 user     ftp  %11ld %s %02i %5i %s\r\n", st.st_size, month_table[s_time->tm_mon], s_time->tm_mday, s_time->tm_year + 1900, fsd->vfs_dirent->name);
-			if (VFS_ISDIR(st.st_mode))
-				buffer[0] = 'd';
-			if (sfifo_space(&fsd->fifo) < len) {
-				send_data(pcb, fsd);
-				return;
+	s_time = gmtime(&st->st_mtime);
+	if (s_time->tm_year == year)
+		len = sprintf(buffer, "-rw-rw-rw-   1 user     ftp  %11ld %s %02i %02i:%02i %s\r\n", st->st_size, month_table[s_time->tm_mon], s_time->tm_mday, s_time->tm_hour, s_time->tm_min, de->name);
+	else
+		len = sprintf(buffer, "-rw-rw-rw-   1 user     ftp  %11ld %s %02i %5i %s\r\n", st->st_size, month_table[s_time->tm_mon], s_time->tm_mday, s_time->tm_year + 1900, de->name);
+	if (VFS_ISDIR(st->st_mode))
+		buffer[0] = 'd';
+	return len;
+}
+
+static struct ftpd_listing *listing_render(vfs_dir_t *dir, enum ftpd_listfmt format, int year)
+{
+	struct ftpd_listing *l = heap_calloc(HEAP_FTPD, 1, sizeof(struct ftpd_listing));
+	vfs_direntbuf_t buf;
+	int r;
+
+	if (l == NULL)
+		return NULL;
+	l->refs = 1;
+	l->format = format;
+	l->year = year;
+	while ((r = vfs_readdir_r(dir, &buf.de, sizeof(buf))) != 0) {
+		int need;
+		if (r < 0) {
+			if (r == -ENAMETOOLONG)
+				continue;
+			break;
+		}
+		need = l->len + strlen(buf.de.name) + 128;
+		if (need > l->size) {
+			int size = (l->size ? 2 * l->size : 1024);
+			char *data;
+			while (size < need)
+				size *= 2;
+			if ((data = heap_realloc(HEAP_FTPD, l->data, size)) == NULL) {
+				listing_put(l);
+				return NULL;
 			}
-			sfifo_write(&fsd->fifo, buffer, len);
-			fsd->vfs_dirent = NULL;
+			l->data = data;
+			l->size = size;
 		}
-	} else {
-		struct ftpd_msgstate *fsm;
-		struct tcp_pcb *msgpcb;
+		l->len += format_dirent(l->data + l->len, &buf.de, format, year);
+		if (VFS_ISVOLATILE(buf.de.st.st_mode))
+			l->uncacheable = 1;
+	}
+	return l;
+}
 
-		if (sfifo_used(&fsd->fifo) > 0) {
-			send_data(pcb, fsd);
-			return;
-		}
-		fsm = fsd->msgfs;
-		msgpcb = fsd->msgpcb;
+/*
+ * Listings are sent straight from the rendered text, without copying.
+ */
+static void send_listing(struct ftpd_datastate *fsd, struct tcp_pcb *pcb)
+{
+	struct ftpd_msgstate *fsm;
+	struct tcp_pcb *msgpcb;
 
-		vfs_closedir(fsd->vfs_dir);
-		fsd->vfs_dir = NULL;
-		ftpd_dataclose(pcb, fsd);
-		fsm->datapcb = NULL;
-		fsm->datafs = NULL;
-		fsm->state = FTPD_IDLE;
-		send_msg(msgpcb, fsm, msg226);
+	send_mapped(pcb, fsd);
+	if (fsd->map_left > 0 || fsd->inflight > 0)
 		return;
-	}
-	}
+
+	fsm = fsd->msgfs;
+	msgpcb = fsd->msgpcb;
+
+	ftpd_dataclose(pcb, fsd);
+	fsm->datapcb = NULL;
+	fsm->datafs = NULL;
+	fsm->state = FTPD_IDLE;
+	ftpd_stats.transfers++;
+	send_msg(msgpcb, fsm, msg226);
+	ftpd_msgprocess(msgpcb, fsm);
 }
 
-static err_t ftpd_datasent(void *arg, struct tcp_pcb *pcb, u16_t len)
+/* Start the progress report of a transfer */
+static void ftpd_datastart(struct ftpd_datastate *fsd, const char *name, unsigned long total)
 {
-	struct ftpd_datastate *fsd = arg;
+	fsd->name = (name ? heap_strdup(HEAP_FTPD, name) : NULL);
+	fsd->total = total;
+	fsd->sent = fsd->sample_sent = fsd->rate = 0;
+	fsd->sample_clock = stats_clock();
+	fsd->started = time(NULL);
+}
 
+/*
+ * Push out whatever the current transfer has ready.
+ */
+static void ftpd_datacontinue(struct ftpd_datastate *fsd, struct tcp_pcb *pcb)
+{
 	switch (fsd->msgfs->state) {
 	case FTPD_LIST:
-		send_next_directory(fsd, pcb, 0);
-		break;
 	case FTPD_NLST:
-		send_next_directory(fsd, pcb, 1);
+	case FTPD_MLSD:
+		send_listing(fsd, pcb);
 		break;
 	case FTPD_RETR:
 		send_file(fsd, pcb);
@@ -600,6 +1128,35 @@ static err_t ftpd_datasent(void *arg, struct tcp_pcb *pcb, u16_t len)
 	}
 	if (pcb->unsent && !pcb->unacked)
 		tcp_output(pcb);
+}
+
+static err_t ftpd_datasent(void *arg, struct tcp_pcb *pcb, u16_t len)
+{
+	struct ftpd_datastate *fsd = arg;
+	unsigned long now;
+
+	ftpd_stats.bytes_sent += len;
+	fsd->sent += len;
+	now = stats_clock();
+	if (now - fsd->sample_clock >= STATS_CLOCK_HZ) {
+		/* Bytes per second over the last second or so */
+		fsd->rate = (unsigned long)((unsigned long long)
+			(fsd->sent - fsd->sample_sent) * STATS_CLOCK_HZ /
+			(now - fsd->sample_clock));
+		fsd->sample_clock = now;
+		fsd->sample_sent = fsd->sent;
+	}
+	if (fsd->sent_start) {
+		/* Time from queueing data until the first of it was acked */
+		trace_end("tcp_sent", TRACE_FTPD, fsd->sent_start, len);
+		fsd->sent_start = 0;
+	}
+	if (fsd->inflight > len)
+		fsd->inflight -= len;
+	else
+		fsd->inflight = 0;
+
+	ftpd_datacontinue(fsd, pcb);
 
 	return ERR_OK;
 }
@@ -639,7 +1196,9 @@ static err_t ftpd_datarecv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t
 		fsm->datapcb = NULL;
 		fsm->datafs = NULL;
 		fsm->state = FTPD_IDLE;
+		ftpd_stats.transfers++;
 		send_msg(msgpcb, fsm, msg226);
+		ftpd_msgprocess(msgpcb, fsm);
 	}
 
 	return ERR_OK;
@@ -651,6 +1210,7 @@ static err_t ftpd_dataconnected(void *arg, struct tcp_pcb *pcb, err_t err)
 
 	fsd->msgfs->datapcb = pcb;
 	fsd->connected = 1;
+	size_data_fifo(fsd, pcb);
 
 	/* Tell TCP that we wish to be informed of incoming data by a call
 	   to the http_recv() function. */
@@ -662,21 +1222,7 @@ static err_t ftpd_dataconnected(void *arg, struct tcp_pcb *pcb, err_t err)
 
 	tcp_err(pcb, ftpd_dataerr);
 
-	switch (fsd->msgfs->state) {
-	case FTPD_LIST:
-		send_next_directory(fsd, pcb, 0);
-		break;
-	case FTPD_NLST:
-		send_next_directory(fsd, pcb, 1);
-		break;
-	case FTPD_RETR:
-		send_file(fsd, pcb);
-		break;
-	default:
-		break;
-	}
-	if (pcb->unsent && !pcb->unacked)
-		tcp_output(pcb);
+	ftpd_datacontinue(fsd, pcb);
 
 	return ERR_OK;
 }
@@ -687,6 +1233,7 @@ static err_t ftpd_dataaccept(void *arg, struct tcp_pcb *pcb, err_t err)
 
 	fsd->msgfs->datapcb = pcb;
 	fsd->connected = 1;
+	size_data_fifo(fsd, pcb);
 
 	/* Tell TCP that we wish to be informed of incoming data by a call
 	   to the http_recv() function. */
@@ -698,33 +1245,122 @@ static err_t ftpd_dataaccept(void *arg, struct tcp_pcb *pcb, err_t err)
 
 	tcp_err(pcb, ftpd_dataerr);
 
-	switch (fsd->msgfs->state) {
-	case FTPD_LIST:
-		send_next_directory(fsd, pcb, 0);
-		break;
-	case FTPD_NLST:
-		send_next_directory(fsd, pcb, 1);
-		break;
-	case FTPD_RETR:
-		send_file(fsd, pcb);
-		break;
-	default:
-		break;
+	ftpd_datacontinue(fsd, pcb);
+
+	return ERR_OK;
+}
+
+#ifndef FTPD_PASV_POOL
+#define FTPD_PASV_POOL 4
+#endif
+#define FTPD_PASV_PORT_MIN 4096
+#define FTPD_PASV_PORT_MAX 0x7fff
+
+/*
+ * Passive mode listeners are set up ahead of time, so that PASV only
+ * has to hand one out and the data connection is a plain accept.  A
+ * listener serves one session, and is moved to a fresh port before
+ * it is handed out again.
+ */
+struct ftpd_pasvslot {
+	struct tcp_pcb *pcb;
+	u16_t port;
+	int stale;
+	struct ftpd_msgstate *fsm;
+};
+
+static struct ftpd_pasvslot pasv_pool[FTPD_PASV_POOL];
+static u16_t pasv_port = FTPD_PASV_PORT_MIN;
+
+static err_t ftpd_pasvaccept(void *arg, struct tcp_pcb *pcb, err_t err)
+{
+	struct ftpd_pasvslot *slot = arg;
+	struct ftpd_msgstate *fsm = slot->fsm;
+	struct ftpd_datastate *fsd;
+
+	/* Only the client that asked for the port may connect to it */
+	if (fsm == NULL || fsm->datafs == NULL ||
+	    !ip_addr_cmp(&pcb->remote_ip, &fsm->datafs->msgpcb->remote_ip)) {
+		dbg_printf("ftpd_pasvaccept: unexpected connection\n");
+		tcp_arg(pcb, NULL);
+		tcp_close(pcb);
+		return ERR_OK;
 	}
-	if (pcb->unsent && !pcb->unacked)
-		tcp_output(pcb);
+	fsd = fsm->datafs;
+	slot->fsm = NULL;
+	slot->stale = 1;
+	fsm->pasv = NULL;
+	tcp_arg(pcb, fsd);
+	return ftpd_dataaccept(fsd, pcb, err);
+}
 
-	return ERR_OK;
+/*
+ * Listen on the next port after the one handed out last, skipping
+ * those still in use.
+ */
+static void pasv_refill(struct ftpd_pasvslot *slot)
+{
+	struct tcp_pcb *pcb, *lpcb;
+	u16_t start = pasv_port;
+
+	if (slot->pcb)
+		tcp_close(slot->pcb);
+	slot->pcb = NULL;
+	slot->stale = 0;
+	if (!(pcb = tcp_new()))
+		return;
+	do {
+		if (++pasv_port > FTPD_PASV_PORT_MAX)
+			pasv_port = FTPD_PASV_PORT_MIN;
+		if (tcp_bind(pcb, IP_ADDR_ANY, pasv_port) != ERR_OK)
+			continue;
+		if (!(lpcb = tcp_listen(pcb)))
+			break;
+		slot->pcb = lpcb;
+		slot->port = pasv_port;
+		tcp_arg(lpcb, slot);
+		tcp_accept(lpcb, ftpd_pasvaccept);
+		return;
+	} while (pasv_port != start);
+	tcp_close(pcb);
+}
+
+/*
+ * Forget the data connection of the session, whether it is connected,
+ * still connecting, or a passive one not yet accepted.
+ */
+static void ftpd_datadrop(struct ftpd_msgstate *fsm)
+{
+	if (fsm->pasv) {
+		fsm->pasv->fsm = NULL;
+		fsm->pasv->stale = 1;
+		fsm->pasv = NULL;
+	}
+	if (fsm->datafs) {
+		if (fsm->datapcb)
+			ftpd_dataclose(fsm->datapcb, fsm->datafs);
+		else
+			ftpd_datafree(fsm->datafs);
+	}
+	fsm->datafs = NULL;
+	fsm->datapcb = NULL;
+	fsm->passive = 0;
 }
 
 static int open_dataconnection(struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
 {
-	if (fsm->passive)
-		return 0;
+	if (fsm->passive) {
+		/* PASV only covers the next transfer */
+		fsm->passive = 0;
+		if (fsm->datafs)
+			return 0;
+		send_msg(pcb, fsm, msg425);
+		return 1;
+	}
 
 	/* Allocate memory for the structure that holds the state of the
 	   connection. */
-	fsm->datafs = malloc(sizeof(struct ftpd_datastate));
+	fsm->datafs = pool_alloc(&data_pool);
 
 	if (fsm->datafs == NULL) {
 		send_msg(pcb, fsm, msg451);
@@ -771,12 +1407,18 @@ static void cmd_port(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate
 	unsigned pHi, pLo;
 	unsigned ip[4];
 
+	if (fsm->epsv_all) {
+		send_msg(pcb, fsm, msg503);
+		return;
+	}
 	nr = sscanf(arg, "%u,%u,%u,%u,%u,%u", &(ip[0]), &(ip[1]), &(ip[2]), &(ip[3]), &pHi, &pLo);
 	if (nr != 6) {
 		send_msg(pcb, fsm, msg501);
 	} else {
 		IP4_ADDR(&fsm->dataip, (u8_t) ip[0], (u8_t) ip[1], (u8_t) ip[2], (u8_t) ip[3]);
 		fsm->dataport = ((u16_t) pHi << 8) | (u16_t) pLo;
+		if (fsm->passive && fsm->state == FTPD_IDLE)
+			ftpd_datadrop(fsm);
 		send_msg(pcb, fsm, msg200);
 	}
 }
@@ -811,13 +1453,14 @@ static void cmd_pwd(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *
 
 	if (path = vfs_getcwd(fsm->vfs, NULL, 0)) {
 		send_msg(pcb, fsm, msg257PWD, path);
-		free(path);
+		heap_free(path);
 	}
 }
 
-static void cmd_list_common(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm, int shortlist)
+static void cmd_list_common(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm, enum ftpd_listfmt format)
 {
-	vfs_dir_t *vfs_dir;
+	struct ftpd_listing *listing;
+	int year = 0;
 	char *cwd;
 
 	cwd = vfs_getcwd(fsm->vfs, NULL, 0);
@@ -825,55 +1468,254 @@ static void cmd_list_common(const char *arg, struct tcp_pcb *pcb, struct ftpd_ms
 		send_msg(pcb, fsm, msg451);
 		return;
 	}
-	vfs_dir = vfs_opendir(fsm->vfs, cwd);
-	free(cwd);
-	if (!vfs_dir) {
-		send_msg(pcb, fsm, msg451);
-		return;
+	/* LIST and NLST arguments are ls options, MLSD takes a directory */
+	if (format == LISTFMT_FACTS && *arg) {
+		char *path = heap_alloc(HEAP_FTPD, strlen(cwd) + strlen(arg) + 2);
+		if (path == NULL) {
+			heap_free(cwd);
+			send_msg(pcb, fsm, msg451);
+			return;
+		}
+		if (*arg == '/')
+			strcpy(path, arg);
+		else
+			sprintf(path, "%s/%s", cwd, arg);
+		heap_free(cwd);
+		cwd = path;
+	}
+	if (format == LISTFMT_LONG) {
+		/* Entries from this year show the time instead */
+		time_t now = time(NULL);
+		year = gmtime(&now)->tm_year;
+	}
+
+	listing = listing_lookup(cwd, format, year);
+	if (listing)
+		heap_free(cwd);
+	else {
+		unsigned long gen = vfs_generation();
+		vfs_dir_t *vfs_dir = vfs_opendir(fsm->vfs, cwd);
+		if (vfs_dir) {
+			listing = listing_render(vfs_dir, format, year);
+			vfs_closedir(vfs_dir);
+		} else if (format == LISTFMT_FACTS && *arg) {
+			/* No such directory, as opposed to failing to list it */
+			heap_free(cwd);
+			send_msg(pcb, fsm, msg550);
+			return;
+		}
+		if (!listing) {
+			heap_free(cwd);
+			send_msg(pcb, fsm, msg451);
+			return;
+		}
+		listing->path = cwd;
+		listing->gen = gen;
+		if (gen == vfs_generation() && !listing->uncacheable)
+			listing_insert(listing);
 	}
 
 	if (open_dataconnection(pcb, fsm) != 0) {
-		vfs_closedir(vfs_dir);
+		listing_put(listing);
 		return;
 	}
 
-	fsm->datafs->vfs_dir = vfs_dir;
-	fsm->datafs->vfs_dirent = NULL;
-	if (shortlist != 0)
+	fsm->datafs->listing = listing;
+	ftpd_datastart(fsm->datafs, NULL, listing->len);
+	fsm->datafs->map_ptr = listing->data;
+	fsm->datafs->map_left = listing->len;
+	if (format == LISTFMT_NAMES)
 		fsm->state = FTPD_NLST;
+	else if (format == LISTFMT_FACTS)
+		fsm->state = FTPD_MLSD;
 	else
 		fsm->state = FTPD_LIST;
 
 	send_msg(pcb, fsm, msg150);
+	if (fsm->datafs->connected)
+		ftpd_datacontinue(fsm->datafs, fsm->datapcb);
 }
 
 static void cmd_nlst(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
 {
-	cmd_list_common(arg, pcb, fsm, 1);
+	cmd_list_common(arg, pcb, fsm, LISTFMT_NAMES);
 }
 
 static void cmd_list(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
 {
-	cmd_list_common(arg, pcb, fsm, 0);
+	cmd_list_common(arg, pcb, fsm, LISTFMT_LONG);
 }
 
-static void cmd_retr(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
+static void cmd_mlsd(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
 {
-	vfs_file_t *vfs_file;
+	cmd_list_common(arg, pcb, fsm, LISTFMT_FACTS);
+}
+
+static void cmd_mlst(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
+{
+	char buffer[128];
 	vfs_stat_t st;
+	char *cwd = NULL;
+	const char *name = arg;
 
-	vfs_stat(fsm->vfs, arg, &st);
-	if (!VFS_ISREG(st.st_mode)) {
+	if (vfs_stat(fsm->vfs, (*arg ? arg : "."), &st) != 0) {
+		send_msg(pcb, fsm, msg550);
+		return;
+	}
+	if (!*arg && (name = cwd = vfs_getcwd(fsm->vfs, NULL, 0)) == NULL) {
+		send_msg(pcb, fsm, msg451);
+		return;
+	}
+	format_facts(buffer, &st);
+	send_msg(pcb, fsm, msg250MLST, name);
+	send_msg(pcb, fsm, " %s%s", buffer, name);
+	send_msg(pcb, fsm, msg250END);
+	if (cwd)
+		heap_free(cwd);
+}
+
+static void cmd_size(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
+{
+	vfs_stat_t st;
+
+	if (vfs_stat(fsm->vfs, arg, &st) != 0 || !VFS_ISREG(st.st_mode)) {
 		send_msg(pcb, fsm, msg550);
 		return;
 	}
+	send_msg(pcb, fsm, msg213SIZE, (unsigned long)st.st_size);
+}
+
+/*
+ * STAT without arguments reports on the transfer in progress, and can
+ * be sent while it is running.
+ */
+static void cmd_stat(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
+{
+	struct ftpd_datastate *fsd = fsm->datafs;
+	struct tcp_pcb *dpcb = fsm->datapcb;
+	struct tcp_seg *seg;
+	int unsent = 0, unacked = 0;
+	unsigned long secs, avg;
+
+	if (*arg) {
+		send_msg(pcb, fsm, msg504);
+		return;
+	}
+	send_msg(pcb, fsm, msg211STAT);
+	if (!fsd || (fsm->state != FTPD_RETR && fsm->state != FTPD_LIST &&
+		     fsm->state != FTPD_NLST && fsm->state != FTPD_MLSD)) {
+		send_msg(pcb, fsm, " No transfer in progress.");
+		send_msg(pcb, fsm, msg211STATEND);
+		return;
+	}
+
+	if (fsd->name)
+		send_msg(pcb, fsm, " Sending \"%.200s\"", fsd->name);
+	else
+		send_msg(pcb, fsm, " Sending directory listing");
+	send_msg(pcb, fsm, " %lu of %lu bytes sent (%lu%%)", fsd->sent,
+		 fsd->total, (fsd->total ?
+			      (unsigned long)((100ULL * fsd->sent) / fsd->total) : 0));
+	secs = time(NULL) - fsd->started;
+	avg = (secs ? fsd->sent / secs : 0);
+	send_msg(pcb, fsm, " %lu bytes/s now, %lu bytes/s average over %lu s",
+		 fsd->rate, avg, secs);
+	send_msg(pcb, fsm, " FIFO %d of %d bytes used", sfifo_used(&fsd->fifo),
+		 fsd->fifo.size - 1);
+
+	if (!dpcb || !fsd->connected) {
+		send_msg(pcb, fsm, " Data connection not established");
+		send_msg(pcb, fsm, msg211STATEND);
+		return;
+	}
+	for (seg = dpcb->unsent; seg; seg = seg->next)
+		unsent++;
+	for (seg = dpcb->unacked; seg; seg = seg->next)
+		unacked++;
+	send_msg(pcb, fsm, " Send window %lu, cwnd %lu, ssthresh %lu, sndbuf %u",
+		 (unsigned long)dpcb->snd_wnd, (unsigned long)dpcb->cwnd,
+		 (unsigned long)dpcb->ssthresh, (unsigned)tcp_sndbuf(dpcb));
+	send_msg(pcb, fsm, " Segments unsent %d, unacked %d, queued pbufs %u",
+		 unsent, unacked, (unsigned)dpcb->snd_queuelen);
+	send_msg(pcb, fsm, " Retransmits of oldest unacked segment %u, rtt estimate %d/%d, mss %u",
+		 (unsigned)dpcb->nrtx, dpcb->sa, dpcb->sv, (unsigned)dpcb->mss);
+	send_msg(pcb, fsm, msg211STATEND);
+}
+
+/*
+ * SITE TRACE [ON|OFF|CLEAR] controls the trace ring, which can be
+ * fetched as /stats/trace.json.
+ */
+static void cmd_site(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
+{
+	if (strncasecmp(arg, "TRACE", 5) || (arg[5] != '\0' && arg[5] != ' ')) {
+		send_msg(pcb, fsm, msg504);
+		return;
+	}
+	arg += 5;
+	while (*arg == ' ')
+		arg++;
+	if (!strcasecmp(arg, "ON"))
+		trace_enable(1);
+	else if (!strcasecmp(arg, "OFF"))
+		trace_enable(0);
+	else if (!strcasecmp(arg, "CLEAR"))
+		trace_clear();
+	else if (*arg) {
+		send_msg(pcb, fsm, msg501);
+		return;
+	}
+	send_msg(pcb, fsm, msg200TRACE, (trace_enabled ? "on" : "off"),
+		 trace_count());
+}
+
+static void cmd_feat(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
+{
+	send_msg(pcb, fsm, msg211FEAT);
+	send_msg(pcb, fsm, " EPSV");
+	send_msg(pcb, fsm, " MLST type*;size*;modify*;unique*;");
+	send_msg(pcb, fsm, " RANG STREAM");
+	send_msg(pcb, fsm, " REST STREAM");
+	send_msg(pcb, fsm, " SIZE");
+	send_msg(pcb, fsm, msg211END);
+}
+
+static void cmd_retr(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
+{
+	vfs_file_t *vfs_file;
+	vfs_stat_t st;
+	unsigned long start = fsm->rest, end, left;
+	int rang = fsm->rang;
+
+	/* A range, like a restart offset, is for this RETR only */
+	fsm->rest = 0;
+	fsm->rang = 0;
+	/* The size is taken from the open file, as generated files differ
+	   from one open to the next */
 	vfs_file = vfs_open(fsm->vfs, arg, "rb");
 	if (!vfs_file) {
 		send_msg(pcb, fsm, msg550);
 		return;
 	}
+	if (vfs_fstat(vfs_file, &st) != 0 || !VFS_ISREG(st.st_mode)) {
+		vfs_close(vfs_file);
+		send_msg(pcb, fsm, msg550);
+		return;
+	}
+	end = (rang ? fsm->rang_end + 1 : st.st_size);
+	if (start > end || end > st.st_size) {
+		vfs_close(vfs_file);
+		send_msg(pcb, fsm, msg554);
+		return;
+	}
+	left = end - start;
+	if (start && vfs_seek(vfs_file, start) != 0) {
+		vfs_close(vfs_file);
+		send_msg(pcb, fsm, msg554);
+		return;
+	}
 
-	send_msg(pcb, fsm, msg150recv, arg, st.st_size);
+	send_msg(pcb, fsm, msg150recv, arg, (int)left);
 
 	if (open_dataconnection(pcb, fsm) != 0) {
 		vfs_close(vfs_file);
@@ -881,13 +1723,24 @@ static void cmd_retr(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate
 	}
 
 	fsm->datafs->vfs_file = vfs_file;
+	fsm->datafs->posn = start;
+	fsm->datafs->left = left;
+	fsm->datafs->blksize = st.st_blksize;
+	ftpd_datastart(fsm->datafs, arg, left);
+	vfs_notify(vfs_file, ftpd_datanotify, fsm->datafs);
 	fsm->state = FTPD_RETR;
+	if (fsm->datafs->connected) {
+		size_data_fifo(fsm->datafs, fsm->datapcb);
+		ftpd_datacontinue(fsm->datafs, fsm->datapcb);
+	}
 }
 
 static void cmd_stor(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
 {
 	vfs_file_t *vfs_file;
 
+	/* Nothing can be written at an offset */
+	fsm->rest = 0;
 	vfs_file = vfs_open(fsm->vfs, arg, "wb");
 	if (!vfs_file) {
 		send_msg(pcb, fsm, msg550);
@@ -905,6 +1758,59 @@ static void cmd_stor(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate
 	fsm->state = FTPD_STOR;
 }
 
+static void cmd_rest(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
+{
+	char *end;
+	unsigned long offset;
+
+	offset = strtoul(arg, &end, 10);
+	if (!isdigit((unsigned char)*arg) || *end != '\0') {
+		send_msg(pcb, fsm, msg501);
+		return;
+	}
+	/* REST and RANG exclude each other */
+	fsm->rang = 0;
+	fsm->rest = offset;
+	send_msg(pcb, fsm, msg350REST, offset);
+}
+
+/*
+ * RANG first last, from draft-bryan-ftp-range.  Both ends are
+ * inclusive, and "RANG 1 0" goes back to whole files.  Like REST, the
+ * range is used up by the next RETR.
+ */
+static void cmd_rang(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
+{
+	char *end;
+	unsigned long first, last;
+
+	first = strtoul(arg, &end, 10);
+	if (!isdigit((unsigned char)*arg) || *end != ' ' ||
+	    !isdigit((unsigned char)end[1])) {
+		send_msg(pcb, fsm, msg501);
+		return;
+	}
+	last = strtoul(end + 1, &end, 10);
+	if (*end != '\0') {
+		send_msg(pcb, fsm, msg501);
+		return;
+	}
+	if (first == 1 && last == 0) {
+		fsm->rang = 0;
+		fsm->rest = 0;
+		send_msg(pcb, fsm, msg350RANGEOF);
+		return;
+	}
+	if (first > last) {
+		send_msg(pcb, fsm, msg501);
+		return;
+	}
+	fsm->rang = 1;
+	fsm->rest = first;
+	fsm->rang_end = last;
+	send_msg(pcb, fsm, msg350RANG, first, last);
+}
+
 static void cmd_noop(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
 {
 	send_msg(pcb, fsm, msg200);
@@ -915,87 +1821,100 @@ static void cmd_syst(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate
 	send_msg(pcb, fsm, msg214SYST, "UNIX");
 }
 
-static void cmd_pasv(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
+static void pasv_common(struct tcp_pcb *pcb, struct ftpd_msgstate *fsm, int extended)
 {
-	static u16_t port = 4096;
-	static u16_t start_port = 4096;
-	struct tcp_pcb *temppcb;
+	struct ftpd_pasvslot *slot = NULL;
+	int i;
+
+	if (fsm->state != FTPD_IDLE) {
+		send_msg(pcb, fsm, msg503);
+		return;
+	}
+	ftpd_datadrop(fsm);
+
+	for (i = 0; i < FTPD_PASV_POOL; i++) {
+		struct ftpd_pasvslot *s = &pasv_pool[i];
+		if (s->fsm)
+			continue;
+		if (s->stale || !s->pcb)
+			pasv_refill(s);
+		if (s->pcb && !slot)
+			slot = s;
+	}
+	if (!slot) {
+		send_msg(pcb, fsm, msg425);
+		return;
+	}
 
 	/* Allocate memory for the structure that holds the state of the
 	   connection. */
-	fsm->datafs = malloc(sizeof(struct ftpd_datastate));
+	fsm->datafs = pool_alloc(&data_pool);
 
 	if (fsm->datafs == NULL) {
 		send_msg(pcb, fsm, msg451);
 		return;
 	}
 	memset(fsm->datafs, 0, sizeof(struct ftpd_datastate));
-
-	fsm->datapcb = tcp_new();
-	if (!fsm->datapcb) {
-		free(fsm->datafs);
-		send_msg(pcb, fsm, msg451);
-		return;
-	}
-
 	sfifo_init(&fsm->datafs->fifo, 2000);
+	fsm->datafs->msgfs = fsm;
+	fsm->datafs->msgpcb = pcb;
 
-	start_port = port;
-
-	while (1) {
-		err_t err;
+	slot->fsm = fsm;
+	fsm->pasv = slot;
+	fsm->passive = 1;
+	fsm->dataport = slot->port;
 
-		if(++port > 0x7fff)
-			port = 4096;
+	if (extended)
+		send_msg(pcb, fsm, msg229, fsm->dataport);
+	else
+		send_msg(pcb, fsm, msg227, ip4_addr1(&pcb->local_ip), ip4_addr2(&pcb->local_ip), ip4_addr3(&pcb->local_ip), ip4_addr4(&pcb->local_ip), (fsm->dataport >> 8) & 0xff, (fsm->dataport) & 0xff);
+}
 
-		fsm->dataport = port;
-		err = tcp_bind(fsm->datapcb, &pcb->local_ip, fsm->dataport);
-		if (err == ERR_OK)
-			break;
-		if (start_port == port)
-			err = ERR_CLSD;
-		if (err == ERR_USE)
-			continue;
-		if (err != ERR_OK) {
-			ftpd_dataclose(fsm->datapcb, fsm->datafs);
-			fsm->datapcb = NULL;
-			fsm->datafs = NULL;
-			return;
-		}
+static void cmd_pasv(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
+{
+	if (fsm->epsv_all) {
+		send_msg(pcb, fsm, msg503);
+		return;
 	}
+	pasv_common(pcb, fsm, 0);
+}
 
-	temppcb = tcp_listen(fsm->datapcb);
-	if (!temppcb) {
-		ftpd_dataclose(fsm->datapcb, fsm->datafs);
-		fsm->datapcb = NULL;
-		fsm->datafs = NULL;
+/*
+ * EPSV from RFC 2428.  Only IPv4 is supported, and after EPSV ALL
+ * the client has promised not to use PORT or PASV.
+ */
+static void cmd_epsv(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
+{
+	if (!strcasecmp(arg, "ALL")) {
+		fsm->epsv_all = 1;
+		send_msg(pcb, fsm, msg200);
 		return;
 	}
-	fsm->datapcb = temppcb;
-
-	fsm->passive = 1;
-	fsm->datafs->connected = 0;
-	fsm->datafs->msgfs = fsm;
-	fsm->datafs->msgpcb = pcb;
-
-	/* Tell TCP that this is the structure we wish to be passed for our
-	   callbacks. */
-	tcp_arg(fsm->datapcb, fsm->datafs);
-
-	tcp_accept(fsm->datapcb, ftpd_dataaccept);
-	send_msg(pcb, fsm, msg227, ip4_addr1(&pcb->local_ip), ip4_addr2(&pcb->local_ip), ip4_addr3(&pcb->local_ip), ip4_addr4(&pcb->local_ip), (fsm->dataport >> 8) & 0xff, (fsm->dataport) & 0xff);
+	if (*arg && strcmp(arg, "1")) {
+		send_msg(pcb, fsm, msg522);
+		return;
+	}
+	pasv_common(pcb, fsm, 1);
 }
 
 static void cmd_abrt(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
 {
+	if (fsm->pasv) {
+		fsm->pasv->fsm = NULL;
+		fsm->pasv->stale = 1;
+		fsm->pasv = NULL;
+	}
+	fsm->passive = 0;
 	if (fsm->datafs != NULL) {
-		tcp_arg(fsm->datapcb, NULL);
-		tcp_sent(fsm->datapcb, NULL);
-		tcp_recv(fsm->datapcb, NULL);
-		tcp_arg(fsm->datapcb, NULL);
-		tcp_abort(pcb);
-		sfifo_close(&fsm->datafs->fifo);
-		free(fsm->datafs);
+		if (fsm->datapcb) {
+			tcp_arg(fsm->datapcb, NULL);
+			tcp_sent(fsm->datapcb, NULL);
+			tcp_recv(fsm->datapcb, NULL);
+			tcp_err(fsm->datapcb, NULL);
+			tcp_abort(fsm->datapcb);
+			fsm->datapcb = NULL;
+		}
+		ftpd_datafree(fsm->datafs);
 		fsm->datafs = NULL;
 	}
 	fsm->state = FTPD_IDLE;
@@ -1027,8 +1946,8 @@ static void cmd_rnfr(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate
 		return;
 	}
 	if (fsm->renamefrom)
-		free(fsm->renamefrom);
-	fsm->renamefrom = malloc(strlen(arg) + 1);
+		heap_free(fsm->renamefrom);
+	fsm->renamefrom = heap_alloc(HEAP_FTPD, strlen(arg) + 1);
 	if (fsm->renamefrom == NULL) {
 		send_msg(pcb, fsm, msg451);
 		return;
@@ -1137,34 +2056,107 @@ struct ftpd_command {
 };
 
 static struct ftpd_command ftpd_commands[] = {
-	"USER", cmd_user,
-	"PASS", cmd_pass,
-	"PORT", cmd_port,
-	"QUIT", cmd_quit,
-	"CWD", cmd_cwd,
-	"CDUP", cmd_cdup,
-	"PWD", cmd_pwd,
-	"XPWD", cmd_pwd,
-	"NLST", cmd_nlst,
-	"LIST", cmd_list,
-	"RETR", cmd_retr,
-	"STOR", cmd_stor,
-	"NOOP", cmd_noop,
-	"SYST", cmd_syst,
-	"ABOR", cmd_abrt,
-	"TYPE", cmd_type,
-	"MODE", cmd_mode,
-	"RNFR", cmd_rnfr,
-	"RNTO", cmd_rnto,
-	"MKD", cmd_mkd,
-	"XMKD", cmd_mkd,
-	"RMD", cmd_rmd,
-	"XRMD", cmd_rmd,
-	"DELE", cmd_dele,
-	//"PASV", cmd_pasv,
-	NULL
+	{"USER", cmd_user},
+	{"PASS", cmd_pass},
+	{"PORT", cmd_port},
+	{"QUIT", cmd_quit},
+	{"CWD", cmd_cwd},
+	{"CDUP", cmd_cdup},
+	{"PWD", cmd_pwd},
+	{"XPWD", cmd_pwd},
+	{"NLST", cmd_nlst},
+	{"LIST", cmd_list},
+	{"RETR", cmd_retr},
+	{"STOR", cmd_stor},
+	{"NOOP", cmd_noop},
+	{"SYST", cmd_syst},
+	{"ABOR", cmd_abrt},
+	{"TYPE", cmd_type},
+	{"MODE", cmd_mode},
+	{"RNFR", cmd_rnfr},
+	{"RNTO", cmd_rnto},
+	{"MKD", cmd_mkd},
+	{"XMKD", cmd_mkd},
+	{"RMD", cmd_rmd},
+	{"XRMD", cmd_rmd},
+	{"DELE", cmd_dele},
+	{"REST", cmd_rest},
+	{"RANG", cmd_rang},
+	{"MLSD", cmd_mlsd},
+	{"MLST", cmd_mlst},
+	{"SIZE", cmd_size},
+	{"FEAT", cmd_feat},
+	{"PASV", cmd_pasv},
+	{"EPSV", cmd_epsv},
+	{"SITE", cmd_site},
+	{"STAT", cmd_stat},
+	{NULL}
 };
 
+/*
+ * Commands are looked up by their name packed into an integer, in an
+ * open addressed hash table that is filled in by ftpd_init().
+ */
+#define FTPD_CMD_HASH 128
+
+static struct ftpd_command *ftpd_cmdhash[FTPD_CMD_HASH];
+
+static u32_t ftpd_opcode(const char *name, int *len)
+{
+	u32_t op = 0;
+	int n;
+
+	for (n = 0; n < 4 && isalpha((unsigned char)name[n]); n++)
+		op = (op << 8) | toupper((unsigned char)name[n]);
+	if (len)
+		*len = n;
+	return op;
+}
+
+static unsigned ftpd_cmdslot(u32_t op)
+{
+	return (op * 2654435761u) >> 25;
+}
+
+static void ftpd_cmdhash_init(void)
+{
+	struct ftpd_command *c;
+
+	for (c = ftpd_commands; c->cmd != NULL; c++) {
+		unsigned h = ftpd_cmdslot(ftpd_opcode(c->cmd, NULL));
+		while (ftpd_cmdhash[h])
+			h = (h + 1) % FTPD_CMD_HASH;
+		ftpd_cmdhash[h] = c;
+	}
+}
+
+static void ftpd_dispatch(char *text, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
+{
+	struct ftpd_command *c;
+	int len;
+	u32_t op = ftpd_opcode(text, &len);
+	unsigned h = ftpd_cmdslot(op);
+	const char *arg;
+
+	dbg_printf("query: %s\n", text);
+
+	while ((c = ftpd_cmdhash[h]) != NULL &&
+	       ftpd_opcode(c->cmd, NULL) != op)
+		h = (h + 1) % FTPD_CMD_HASH;
+
+	if (text[len] == '\0')
+		arg = "";
+	else
+		arg = &text[len + 1];
+
+	if (c != NULL && len > 0) {
+		unsigned long t = trace_begin();
+		c->func(arg, pcb, fsm);
+		trace_end(c->cmd, TRACE_FTPD, t, 0);
+	} else
+		send_msg(pcb, fsm, msg502);
+}
+
 static void send_msgdata(struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
 {
 	err_t err;
@@ -1236,15 +2228,18 @@ static void ftpd_msgerr(void *arg, err_t err)
 	dbg_printf("ftpd_msgerr: %s (%i)\n", lwip_strerr(err), err);
 	if (fsm == NULL)
 		return;
-	if (fsm->datafs)
-		ftpd_dataclose(fsm->datapcb, fsm->datafs);
+	ftpd_datadrop(fsm);
+	if (fsm->rxq)
+		pbuf_free(fsm->rxq);
+	fsm->rxq = NULL;
 	sfifo_close(&fsm->fifo);
 	vfs_closefs(fsm->vfs);
 	fsm->vfs = NULL;
 	if (fsm->renamefrom)
-		free(fsm->renamefrom);
+		heap_free(fsm->renamefrom);
 	fsm->renamefrom = NULL;
-	free(fsm);
+	pool_free(&session_pool, fsm);
+	ftpd_stats.sessions--;
 }
 
 static void ftpd_msgclose(struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
@@ -1252,15 +2247,18 @@ static void ftpd_msgclose(struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
 	tcp_arg(pcb, NULL);
 	tcp_sent(pcb, NULL);
 	tcp_recv(pcb, NULL);
-	if (fsm->datafs)
-		ftpd_dataclose(fsm->datapcb, fsm->datafs);
+	ftpd_datadrop(fsm);
+	if (fsm->rxq)
+		pbuf_free(fsm->rxq);
+	fsm->rxq = NULL;
 	sfifo_close(&fsm->fifo);
 	vfs_closefs(fsm->vfs);
 	fsm->vfs = NULL;
 	if (fsm->renamefrom)
-		free(fsm->renamefrom);
+		heap_free(fsm->renamefrom);
 	fsm->renamefrom = NULL;
-	free(fsm);
+	pool_free(&session_pool, fsm);
+	ftpd_stats.sessions--;
 	tcp_arg(pcb, NULL);
 	tcp_close(pcb);
 }
@@ -1280,58 +2278,101 @@ static err_t ftpd_msgsent(void *arg, struct tcp_pcb *pcb, u16_t len)
 	return ERR_OK;
 }
 
-static err_t ftpd_msgrecv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err)
+/*
+ * While a transfer runs, further commands wait in rxq, with the window
+ * closed on them, until it is done.  Only ABOR and STAT are let through.
+ */
+static int ftpd_msgwait(struct ftpd_msgstate *fsm)
 {
-	char *text;
-	struct ftpd_msgstate *fsm = arg;
-
-	if (err == ERR_OK && p != NULL) {
-
-		/* Inform TCP that we have taken the data. */
-		tcp_recved(pcb, p->tot_len);
-
-		text = malloc(p->tot_len + 1);
-		if (text) {
-			char cmd[5];
-			struct pbuf *q;
-			char *pt = text;
-			struct ftpd_command *ftpd_cmd;
-
-			for (q = p; q != NULL; q = q->next) {
-				bcopy(q->payload, pt, q->len);
-				pt += q->len;
-			}
-			*pt = '\0';
-
-			pt = &text[strlen(text) - 1];
-			while (((*pt == '\r') || (*pt == '\n')) && pt >= text)
-				*pt-- = '\0';
-
-			dbg_printf("query: %s\n", text);
+	u32_t op;
 
-			strncpy(cmd, text, 4);
-			for (pt = cmd; isalpha(*pt) && pt < &cmd[4]; pt++)
-				*pt = toupper(*pt);
-			*pt = '\0';
+	switch (fsm->state) {
+	case FTPD_NLST:
+	case FTPD_LIST:
+	case FTPD_MLSD:
+	case FTPD_RETR:
+	case FTPD_STOR:
+		op = ftpd_opcode(fsm->line, NULL);
+		return op != ftpd_opcode("ABOR", NULL) &&
+			op != ftpd_opcode("STAT", NULL);
+	case FTPD_QUIT:
+		return 1;
+	default:
+		return 0;
+	}
+}
 
-			for (ftpd_cmd = ftpd_commands; ftpd_cmd->cmd != NULL; ftpd_cmd++) {
-				if (!strcmp(ftpd_cmd->cmd, cmd))
-					break;
-			}
+/*
+ * Assemble received data into lines and run them as commands, in
+ * order, for as long as the session is ready for the next one.
+ */
+static void ftpd_msgprocess(struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
+{
+	if (fsm->processing)
+		return;
+	fsm->processing = 1;
+	for (;;) {
+		struct pbuf *p;
+		const char *data;
+		u16_t n;
+
+		if (fsm->linedone) {
+			if (ftpd_msgwait(fsm))
+				break;
+			fsm->linedone = 0;
+			fsm->linelen = 0;
+			ftpd_dispatch(fsm->line, pcb, fsm);
+			continue;
+		}
+		if ((p = fsm->rxq) == NULL)
+			break;
 
-			if (strlen(text) < (strlen(cmd) + 1))
-				pt = "";
+		data = (const char *)p->payload;
+		for (n = fsm->rxoff; n < p->len && !fsm->linedone; n++) {
+			char c = data[n];
+			if (c == '\n') {
+				/* Drop the CR, and lines that were too long */
+				if (fsm->linelen > 0 && fsm->line[fsm->linelen - 1] == '\r')
+					fsm->linelen--;
+				fsm->line[fsm->linelen] = '\0';
+				if (fsm->linebad) {
+					fsm->linebad = 0;
+					fsm->linelen = 0;
+					send_msg(pcb, fsm, msg500);
+				} else if (fsm->linelen > 0)
+					fsm->linedone = 1;
+			} else if (fsm->linelen < FTPD_LINE_MAX - 1)
+				fsm->line[fsm->linelen++] = c;
 			else
-				pt = &text[strlen(cmd) + 1];
+				fsm->linebad = 1;
+		}
+		tcp_recved(pcb, n - fsm->rxoff);
+		if (n < p->len)
+			fsm->rxoff = n;
+		else {
+			fsm->rxq = p->next;
+			fsm->rxoff = 0;
+			if (fsm->rxq)
+				pbuf_ref(fsm->rxq);
+			pbuf_free(p);
+		}
+	}
+	fsm->processing = 0;
+}
 
-			if (ftpd_cmd->func)
-				ftpd_cmd->func(pt, pcb, fsm);
-			else
-				send_msg(pcb, fsm, msg502);
+static err_t ftpd_msgrecv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err)
+{
+	struct ftpd_msgstate *fsm = arg;
 
-			free(text);
+	if (err == ERR_OK && p != NULL) {
+		if (fsm->rxq) {
+			pbuf_chain(fsm->rxq, p);
+			pbuf_free(p);
+		} else {
+			fsm->rxq = p;
+			fsm->rxoff = 0;
 		}
-		pbuf_free(p);
+		ftpd_msgprocess(pcb, fsm);
 	}
 
 	return ERR_OK;
@@ -1344,26 +2385,16 @@ static err_t ftpd_msgpoll(void *arg, struct tcp_pcb *pcb)
 	if (fsm == NULL)
 		return ERR_OK;
 
-	if (fsm->datafs) {
-		if (fsm->datafs->connected) {
-			switch (fsm->state) {
-			case FTPD_LIST:
-				send_next_directory(fsm->datafs, fsm->datapcb, 0);
-				break;
-			case FTPD_NLST:
-				send_next_directory(fsm->datafs, fsm->datapcb, 1);
-				break;
-			case FTPD_RETR:
-				send_file(fsm->datafs, fsm->datapcb);
-				break;
-			default:
-				break;
-			}
-			if (fsm->datapcb->unsent && !fsm->datapcb->unacked)
-				tcp_output(fsm->datapcb);
-		}
+	ftpd_stats.msgpoll_wakeups++;
+	if (fsm->datafs && fsm->datafs->connected) {
+		ftpd_stats.msgpoll_busy++;
+		ftpd_datacontinue(fsm->datafs, fsm->datapcb);
 	}
 
+	/* Pick up commands held back by a transfer that ended in error */
+	if (fsm->linedone || fsm->rxq)
+		ftpd_msgprocess(pcb, fsm);
+
 	return ERR_OK;
 }
 
@@ -1373,7 +2404,7 @@ static err_t ftpd_msgaccept(void *arg, struct tcp_pcb *pcb, err_t err)
 
 	/* Allocate memory for the structure that holds the state of the
 	   connection. */
-	fsm = malloc(sizeof(struct ftpd_msgstate));
+	fsm = pool_alloc(&session_pool);
 
 	if (fsm == NULL) {
 		dbg_printf("ftpd_msgaccept: Out of memory\n");
@@ -1386,10 +2417,14 @@ static err_t ftpd_msgaccept(void *arg, struct tcp_pcb *pcb, err_t err)
 	fsm->state = FTPD_IDLE;
 	fsm->vfs = vfs_openfs();
 	if (!fsm->vfs) {
-		free(fsm);
+		sfifo_close(&fsm->fifo);
+		pool_free(&session_pool, fsm);
 		return ERR_CLSD;
 	}
 
+	ftpd_stats.sessions++;
+	ftpd_stats.sessions_total++;
+
 	/* Tell TCP that this is the structure we wish to be passed for our
 	   callbacks. */
 	tcp_arg(pcb, fsm);
@@ -1411,14 +2446,45 @@ static err_t ftpd_msgaccept(void *arg, struct tcp_pcb *pcb, err_t err)
 	return ERR_OK;
 }
 
+static int ftpd_stats_gen(char *buf, size_t size)
+{
+	int len = 0;
+
+	len = stats_printf(buf, size, len,
+			   "sessions %lu\nsessions_total %lu\ntransfers %lu\n"
+			   "bytes_sent %llu\nfifo_stalls %lu\n"
+			   "msgpoll_wakeups %lu\nmsgpoll_busy %lu\n",
+			   ftpd_stats.sessions, ftpd_stats.sessions_total,
+			   ftpd_stats.transfers, ftpd_stats.bytes_sent,
+			   ftpd_stats.fifo_stalls, ftpd_stats.msgpoll_wakeups,
+			   ftpd_stats.msgpoll_busy);
+	return len;
+}
+
 void ftpd_init(void)
 {
 	struct tcp_pcb *pcb;
+	int i;
 
 	vfs_load_plugin(vfs_default_fs);
 
+	pool_init(&session_pool, HEAP_FTPD, "ftpd_session",
+		  sizeof(struct ftpd_msgstate), FTPD_SESSION_POOL);
+	pool_init(&data_pool, HEAP_FTPD, "ftpd_data",
+		  sizeof(struct ftpd_datastate), FTPD_DATA_POOL);
+	pool_init(&fifo_pool, HEAP_FTPD, "ftpd_fifo",
+		  FTPD_FIFO_SIZE, FTPD_SESSION_POOL + FTPD_DATA_POOL);
+	pool_init(&bigfifo_pool, HEAP_FTPD, "ftpd_bigfifo",
+		  FTPD_DATA_BUFSIZE_MAX, FTPD_BIGFIFO_POOL);
+
+	ftpd_cmdhash_init();
+	for (i = 0; i < FTPD_PASV_POOL; i++)
+		pasv_refill(&pasv_pool[i]);
+
+	stats_register("ftpd", ftpd_stats_gen);
+
 	pcb = tcp_new();
-	tcp_bind(pcb, IP_ADDR_ANY, 21);
+	tcp_bind(pcb, IP_ADDR_ANY, FTPD_PORT);
 	pcb = tcp_listen(pcb);
 	tcp_accept(pcb, ftpd_msgaccept);
 }
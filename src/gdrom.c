@@ -29,6 +29,7 @@
  *
  */
 
+#include <stdio.h>
 #include <errno.h>
 #include <lwip/sys.h>
 #include <ronin/gddrive.h>
@@ -37,12 +38,50 @@
 #include "vfs.h"
 #include "vfsnode.h"
 #include "backends.h"
+#include "stats.h"
+#include "trace.h"
+#include "heap.h"
 
 static sys_mbox_t mbox;
+static sys_sem_t drive_sema, cmd_sema;
 
 #define CHK_STATUS_INTERVAL   500 /* twice per second */
+#define CMD_POLL_INTERVAL       2
+/* Number of times the command server is run per poll */
+#define CMD_POLL_SPINS         32
+
+/* Posted to mbox when there are read-ahead buffers waiting to be filled */
+#define MSG_READAHEAD ((void *)-1)
+/* Posted to mbox when read-ahead completions should be delivered */
+#define MSG_WAKEUP ((void *)-2)
+/* Posted to mbox when there are reads on sync_queue */
+#define MSG_SYNCREAD ((void *)-3)
+
+/* Read-ahead geometry, per open track file */
+#ifndef READAHEAD_BUFFERS
+#define READAHEAD_BUFFERS 3
+#endif
+#ifndef READAHEAD_SECTORS
+#define READAHEAD_SECTORS 16
+#endif
+/* Number of back-to-back reads before a file counts as sequential */
+#define READAHEAD_TRIGGER 2
+
+/* RAM set aside for the sector cache shared by all track files */
+#ifndef SECTOR_CACHE_SIZE
+#define SECTOR_CACHE_SIZE (256*1024)
+#endif
+#define SECTOR_CACHE_HASH 64
 
 static vfsnode_t *root = NULL;
+
+/* Only updated from the gdrom thread */
+static struct {
+  unsigned long cmds, errors, datatype_switches, discs;
+  unsigned long reads, sectors;
+  unsigned long long read_ticks;
+  unsigned long read_max;
+} gdrom_stats;
 static struct TOC toc[2];
 static int curr_secsize, curr_secmode;
 
@@ -82,22 +121,63 @@ static int check_cmd(int f)
   else return gdfs_errno_to_errno(blah[0]);
 }
 
-static int wait_cmd(int f)
-{
-  int n;
-  while(!(n = check_cmd(f)));
-  return (n>0? 0 : n);
-}
+/*
+ * Command engine.  Commands are queued from the gdrom thread only and
+ * run one at a time.  Completion is polled from a timeout in the gdrom
+ * thread, and the done callback is called from there.
+ */
 
-static int exec_cmd(int cmd, void *param)
+typedef struct gdcmd_s gdcmd_t;
+
+struct gdcmd_s {
+  gdcmd_t *link;
+  int cmd, handle, result;
+  int secsize, secmode;
+  void *param;
+  struct { int sec, num; void *buffer; int dunno; } read;
+  void (*done)(gdcmd_t *);
+  void *arg;
+  unsigned long start;
+};
+
+static gdcmd_t *cmd_queue = NULL, *cmd_active = NULL;
+
+static void cmd_start(void);
+
+static void cmd_poll(void *arg)
 {
-  int f = send_cmd(cmd, param);
-  return wait_cmd(f);
+  gdcmd_t *c = cmd_active;
+  int i, n = 0;
+  if (!c)
+    return;
+  if (c->handle <= 0)
+    n = -EIO;
+  for (i=0; i<CMD_POLL_SPINS && !n; i++)
+    n = check_cmd(c->handle);
+  if (!n) {
+    sys_timeout(CMD_POLL_INTERVAL, (sys_timeout_handler)cmd_poll, NULL);
+    return;
+  }
+  cmd_active = NULL;
+  c->result = (n>0? 0 : n);
+  if (c->result < 0)
+    gdrom_stats.errors++;
+  if (c->cmd == 16) {
+    unsigned long t = stats_clock() - c->start;
+    gdrom_stats.reads++;
+    gdrom_stats.sectors += c->read.num;
+    gdrom_stats.read_ticks += t;
+    if (t > gdrom_stats.read_max)
+      gdrom_stats.read_max = t;
+    trace_end("read_sectors", TRACE_GDROM, c->start, c->read.num);
+  } else
+    trace_end("drive_cmd", TRACE_GDROM, c->start, c->cmd);
+  cmd_start();
+  c->done(c);
 }
 
-static int read_sectors(int sec, int secsize, int secmode, char *buf, int num)
+static int set_datatype(int secsize, int secmode)
 {
-  struct { int sec, num; void *buffer; int dunno; } param;
   if (secsize != curr_secsize || secmode != curr_secmode) {
     unsigned int param[4];
     param[0] = 0; /* set data type */
@@ -105,16 +185,134 @@ static int read_sectors(int sec, int secsize, int secmode, char *buf, int num)
     param[2] = secmode;
     param[3] = secsize;
     curr_secsize = curr_secmode = -1;
+    gdrom_stats.datatype_switches++;
     if(gdGdcChangeDataType(param)<0)
       return -EIO;
     curr_secsize = secsize;
     curr_secmode = secmode;
   }
-  param.sec = sec;
-  param.num = num;
-  param.buffer = buf;
-  param.dunno = 0;
-  return exec_cmd(16, &param);
+  return 0;
+}
+
+/*
+ * A command that could not be issued is still made active, and fails
+ * from cmd_poll() like any other.  Calling done from here would run it
+ * inside cmd_submit(), with whatever locks the submitter holds.
+ */
+static void cmd_start(void)
+{
+  gdcmd_t *c;
+  if (!cmd_active && (c = cmd_queue)) {
+    cmd_queue = c->link;
+    c->link = NULL;
+    gdrom_stats.cmds++;
+    c->start = stats_clock();
+    if (c->cmd == 16 && set_datatype(c->secsize, c->secmode) < 0)
+      c->handle = 0;
+    else
+      c->handle = send_cmd(c->cmd, c->param);
+    cmd_active = c;
+    sys_timeout(CMD_POLL_INTERVAL, (sys_timeout_handler)cmd_poll, NULL);
+  }
+}
+
+static void cmd_submit(gdcmd_t *c)
+{
+  gdcmd_t **pp;
+  for (pp = &cmd_queue; *pp; pp = &(*pp)->link)
+    ;
+  c->link = NULL;
+  *pp = c;
+  cmd_start();
+}
+
+static void init_read(gdcmd_t *c, int sec, int secsize, int secmode,
+		      char *buf, int num)
+{
+  c->cmd = 16;
+  c->secsize = secsize;
+  c->secmode = secmode;
+  c->read.sec = sec;
+  c->read.num = num;
+  c->read.buffer = buf;
+  c->read.dunno = 0;
+  c->param = &c->read;
+}
+
+static void submit_read(gdcmd_t *c, int sec, int secsize, int secmode,
+			char *buf, int num)
+{
+  init_read(c, sec, secsize, secmode, buf, num);
+  cmd_submit(c);
+}
+
+static void exec_done(gdcmd_t *c)
+{
+  sys_sem_signal(cmd_sema);
+}
+
+/*
+ * Run a command and wait for it.  Only for use by the gdrom thread,
+ * which keeps polling the engine while it waits.
+ */
+static int exec_cmd(int cmd, void *param)
+{
+  gdcmd_t c;
+  memset(&c, 0, sizeof(c));
+  c.cmd = cmd;
+  c.param = param;
+  c.done = exec_done;
+  cmd_submit(&c);
+  sys_sem_wait(cmd_sema);
+  return c.result;
+}
+
+/*
+ * Reads from other threads, handed to the gdrom thread through
+ * sync_queue.  Protected by drive_sema.
+ */
+static gdcmd_t *sync_queue = NULL;
+
+static void sync_done(gdcmd_t *c)
+{
+  sys_sem_signal((sys_sem_t)c->arg);
+}
+
+static void sync_run(void)
+{
+  gdcmd_t *c, *next;
+  sys_sem_wait(drive_sema);
+  c = sync_queue;
+  sync_queue = NULL;
+  sys_sem_signal(drive_sema);
+  for (; c; c = next) {
+    next = c->link;
+    cmd_submit(c);
+  }
+}
+
+/*
+ * Read sectors and wait for them.  For threads other than the gdrom
+ * thread; must be called without drive_sema held.
+ */
+static int read_sync(int sec, int secsize, int secmode, char *buf, int num)
+{
+  gdcmd_t c;
+  sys_sem_t sema = sys_sem_new(0);
+  if (sema == SYS_SEM_NULL)
+    return -ENOMEM;
+  memset(&c, 0, sizeof(c));
+  init_read(&c, sec, secsize, secmode, buf, num);
+  c.done = sync_done;
+  c.arg = (void *)sema;
+  sys_sem_wait(drive_sema);
+  c.link = sync_queue;
+  sync_queue = &c;
+  sys_sem_signal(drive_sema);
+  sys_mbox_post(mbox, MSG_SYNCREAD);
+  sys_sem_wait(sema);
+  sys_sem_free(sema);
+  return c.result;
 }
 
 typedef struct gdrom_track_s {
@@ -126,9 +324,155 @@ typedef struct tracknode_private_s {
   gdrom_track_t track;
 } tracknode_private_t;
 
+/*
+ * Sector cache.  Sectors are keyed by LBA and data type, and evicted in
+ * LRU order.  Protected by drive_sema.
+ */
+
+typedef struct cache_entry_s cache_entry_t;
+
+struct cache_entry_s {
+  cache_entry_t *hash_next, *lru_prev, *lru_next;
+  int sec, secsize, secmode;
+  char data[2352];
+};
+
+static cache_entry_t *cache_hash[SECTOR_CACHE_HASH];
+static cache_entry_t *cache_lru_head = NULL, *cache_lru_tail = NULL;
+static unsigned long cache_hits = 0, cache_misses = 0;
+
+#define CACHE_HASH(sec) ((unsigned)(sec) % SECTOR_CACHE_HASH)
+
+static void cache_lru_unlink(cache_entry_t *e)
+{
+  if (e->lru_prev)
+    e->lru_prev->lru_next = e->lru_next;
+  else
+    cache_lru_head = e->lru_next;
+  if (e->lru_next)
+    e->lru_next->lru_prev = e->lru_prev;
+  else
+    cache_lru_tail = e->lru_prev;
+}
+
+static void cache_lru_push(cache_entry_t *e)
+{
+  e->lru_prev = NULL;
+  if ((e->lru_next = cache_lru_head))
+    cache_lru_head->lru_prev = e;
+  else
+    cache_lru_tail = e;
+  cache_lru_head = e;
+}
+
+static void cache_unhash(cache_entry_t *e)
+{
+  cache_entry_t **pp;
+  for (pp = &cache_hash[CACHE_HASH(e->sec)]; *pp; pp = &(*pp)->hash_next)
+    if (*pp == e) {
+      *pp = e->hash_next;
+      break;
+    }
+  e->sec = -1;
+}
+
+static void cache_init(void)
+{
+  int i, n = SECTOR_CACHE_SIZE / sizeof(cache_entry_t);
+  cache_entry_t *mem = (n > 0?
+			heap_alloc(HEAP_GDROM, n * sizeof(cache_entry_t)) :
+			NULL);
+  if (!mem)
+    return;
+  for (i=0; i<n; i++) {
+    mem[i].sec = -1;
+    mem[i].hash_next = NULL;
+    cache_lru_push(&mem[i]);
+  }
+}
+
+static void cache_flush(void)
+{
+  cache_entry_t *e;
+  for (e = cache_lru_head; e; e = e->lru_next)
+    if (e->sec >= 0)
+      cache_unhash(e);
+}
+
+static cache_entry_t *cache_lookup(int sec, int secsize, int secmode)
+{
+  cache_entry_t *e;
+  for (e = cache_hash[CACHE_HASH(sec)]; e; e = e->hash_next)
+    if (e->sec == sec && e->secsize == secsize && e->secmode == secmode) {
+      cache_lru_unlink(e);
+      cache_lru_push(e);
+      cache_hits++;
+      return e;
+    }
+  cache_misses++;
+  return NULL;
+}
+
+static void cache_insert(int sec, int secsize, int secmode, const char *data)
+{
+  cache_entry_t *e;
+  for (e = cache_hash[CACHE_HASH(sec)]; e; e = e->hash_next)
+    if (e->sec == sec && e->secsize == secsize && e->secmode == secmode)
+      break;
+  if (!e) {
+    if (!(e = cache_lru_tail))
+      return;
+    if (e->sec >= 0)
+      cache_unhash(e);
+    e->sec = sec;
+    e->secsize = secsize;
+    e->secmode = secmode;
+    e->hash_next = cache_hash[CACHE_HASH(sec)];
+    cache_hash[CACHE_HASH(sec)] = e;
+  }
+  memcpy(e->data, data, secsize);
+  cache_lru_unlink(e);
+  cache_lru_push(e);
+}
+
+enum { RA_EMPTY, RA_QUEUED, RA_BUSY, RA_READY, RA_FAILED };
+
+typedef struct trackfile_s trackfile_t;
+
+typedef struct readahead_buf_s {
+  trackfile_t *tf;
+  int sec, num, state, gen;
+  char *data;
+  gdcmd_t cmd;
+} readahead_buf_t;
+
+/*
+ * Per open file state.  Everything below, and the queues linking
+ * trackfiles together, is shared with the gdrom thread and protected
+ * by drive_sema.  A trackfile whose file has been closed while reads
+ * were still in flight is kept around until they complete.
+ */
+struct trackfile_s {
+  tracknode_private_t *private;
+  vfs_file_t *file;
+  trackfile_t *ra_link, *wake_link;
+  int queued, woken, seq, ra_next, gen, busy;
+  unsigned long next_posn;
+  char *ra_mem;
+  readahead_buf_t buf[READAHEAD_BUFFERS];
+};
+
+static trackfile_t *ra_queue = NULL, *wake_queue = NULL;
+
+static void trackfile_free(trackfile_t *tf)
+{
+  heap_free(tf->ra_mem);
+  heap_free(tf);
+}
+
 static void tracknode_init(vfsnode_t *node, void *context)
 {
-  tracknode_private_t *private = calloc(1, sizeof(tracknode_private_t));
+  tracknode_private_t *private = vfsnode_alloc(node, sizeof(tracknode_private_t));
   if (private) {
     private->track = *(gdrom_track_t *)context;
     node->private = private;
@@ -141,6 +485,8 @@ static int tracknode_stat(vfsnode_t *node, const char *path, vfs_stat_t *st)
   if (private) {
     st->st_size = private->track.sectorsize *
       (private->track.end - private->track.start);
+    st->st_blksize = private->track.sectorsize;
+    return 0;
   } else
     return -ENOENT;
 }
@@ -148,19 +494,352 @@ static int tracknode_stat(vfsnode_t *node, const char *path, vfs_stat_t *st)
 static int tracknode_open(vfsnode_t *node, vfs_file_t *file, const char *path,
 			  int write_mode)
 {
+  tracknode_private_t *private = (tracknode_private_t *)node->private;
+  trackfile_t *tf;
   if (*path)
     return -ENOENT;
   if (write_mode)
     return -EROFS;
+  if (!private)
+    return -ENOENT;
+  if (!(tf = heap_calloc(HEAP_GDROM, 1, sizeof(trackfile_t))))
+    return -ENOMEM;
+  tf->private = private;
+  tf->file = file;
+  file->posp = tf;
   file->posn = 0;
   return 0;
 }
 
+static void trackfile_unlink(trackfile_t **queue, trackfile_t *tf, int wake)
+{
+  trackfile_t **pp;
+  for (pp = queue; *pp;
+       pp = (wake? &(*pp)->wake_link : &(*pp)->ra_link))
+    if (*pp == tf) {
+      *pp = (wake? tf->wake_link : tf->ra_link);
+      break;
+    }
+}
+
+static int tracknode_close(vfsnode_t *node, vfs_file_t *file)
+{
+  trackfile_t *tf = file->posp;
+  if (tf) {
+    int busy;
+    sys_sem_wait(drive_sema);
+    if (tf->queued)
+      trackfile_unlink(&ra_queue, tf, 0);
+    if (tf->woken)
+      trackfile_unlink(&wake_queue, tf, 1);
+    tf->queued = tf->woken = 0;
+    tf->file = NULL;
+    busy = tf->busy;
+    sys_sem_signal(drive_sema);
+    if (!busy)
+      trackfile_free(tf);
+    file->posp = NULL;
+  }
+  return 0;
+}
+
+/*
+ * Forget all buffered data.  Buffers with a read in flight can not be
+ * reused until it completes; bumping gen makes the completion discard
+ * the data.
+ */
+static void readahead_reset(trackfile_t *tf)
+{
+  int i;
+  for (i=0; i<READAHEAD_BUFFERS; i++)
+    if (tf->buf[i].state != RA_BUSY)
+      tf->buf[i].state = RA_EMPTY;
+  tf->gen++;
+  tf->seq = 0;
+  tf->ra_next = 0;
+}
+
+/*
+ * Find the filled (or failed) buffer holding sector sec.
+ */
+static readahead_buf_t *readahead_lookup(trackfile_t *tf, int sec)
+{
+  int i;
+  for (i=0; i<READAHEAD_BUFFERS; i++) {
+    readahead_buf_t *rb = &tf->buf[i];
+    if ((rb->state == RA_READY || rb->state == RA_FAILED) &&
+	sec >= rb->sec && sec < rb->sec + rb->num)
+      return rb;
+  }
+  return NULL;
+}
+
+/*
+ * Check if a read of sector sec is already on its way.
+ */
+static int readahead_pending(trackfile_t *tf, int sec)
+{
+  int i;
+  for (i=0; i<READAHEAD_BUFFERS; i++) {
+    readahead_buf_t *rb = &tf->buf[i];
+    if ((rb->state == RA_QUEUED || rb->state == RA_BUSY) &&
+	rb->gen == tf->gen && sec >= rb->sec && sec < rb->sec + rb->num)
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * Recycle the buffers that have been consumed, including queued ones
+ * the reader has already got past, and queue new sectors for the gdrom
+ * thread.  A sequential reader gets every free buffer, other
+ * readers get one buffer holding the sector they wait for, if demand is
+ * set.  Called with drive_sema held.
+ */
+static void readahead_schedule(trackfile_t *tf, unsigned long posn, int demand)
+{
+  gdrom_track_t *track = &tf->private->track;
+  int i, cursec = posn / track->sectorsize + track->start, queued = 0;
+  int want = READAHEAD_BUFFERS;
+
+  for (i=0; i<READAHEAD_BUFFERS; i++) {
+    readahead_buf_t *rb = &tf->buf[i];
+    if ((rb->state == RA_READY || rb->state == RA_FAILED ||
+	 rb->state == RA_QUEUED) && rb->sec + rb->num <= cursec)
+      rb->state = RA_EMPTY;
+  }
+
+  if (tf->seq < READAHEAD_TRIGGER) {
+    if (!demand || readahead_pending(tf, cursec))
+      return;
+    want = 1;
+  }
+
+  if (!tf->ra_mem) {
+    tf->ra_mem = heap_alloc(HEAP_GDROM, READAHEAD_BUFFERS * READAHEAD_SECTORS *
+			    track->sectorsize);
+    if (!tf->ra_mem)
+      return;
+    for (i=0; i<READAHEAD_BUFFERS; i++) {
+      tf->buf[i].tf = tf;
+      tf->buf[i].data = tf->ra_mem +
+	i * READAHEAD_SECTORS * track->sectorsize;
+    }
+  }
+
+  if (tf->ra_next < cursec || tf->ra_next > cursec + READAHEAD_BUFFERS *
+      READAHEAD_SECTORS)
+    tf->ra_next = cursec;
+  for (i=0; i<READAHEAD_BUFFERS && queued < want &&
+	 tf->ra_next < track->end; i++) {
+    readahead_buf_t *rb = &tf->buf[i];
+    if (rb->state != RA_EMPTY)
+      continue;
+    rb->sec = tf->ra_next;
+    rb->num = track->end - rb->sec;
+    if (rb->num > READAHEAD_SECTORS)
+      rb->num = READAHEAD_SECTORS;
+    rb->state = RA_QUEUED;
+    rb->gen = tf->gen;
+    tf->ra_next += rb->num;
+    queued++;
+  }
+
+  if (queued && !tf->queued) {
+    trackfile_t **pp;
+    for (pp = &ra_queue; *pp; pp = &(*pp)->ra_link)
+      ;
+    tf->ra_link = NULL;
+    *pp = tf;
+    tf->queued = 1;
+    sys_mbox_post(mbox, MSG_READAHEAD);
+  }
+}
+
+/*
+ * Queue tf for readahead_wakeup().  Called with drive_sema held.
+ */
+static void readahead_wake(trackfile_t *tf)
+{
+  if (!tf->woken && tf->file) {
+    tf->wake_link = wake_queue;
+    wake_queue = tf;
+    tf->woken = 1;
+    sys_mbox_post(mbox, MSG_WAKEUP);
+  }
+}
+
+static void readahead_done(gdcmd_t *c)
+{
+  readahead_buf_t *rb = c->arg;
+  trackfile_t *tf = rb->tf;
+  /* The node may be gone by now, so don't look at tf->private */
+  int secsize = c->secsize;
+  sys_sem_wait(drive_sema);
+  tf->busy--;
+  if (c->result >= 0) {
+    int i;
+    for (i=0; i<c->read.num; i++)
+      cache_insert(c->read.sec + i, secsize, c->secmode,
+		   ((char *)c->read.buffer) + i * secsize);
+  }
+  if (rb->gen != tf->gen)
+    rb->state = RA_EMPTY;
+  else
+    rb->state = (c->result<0? RA_FAILED : RA_READY);
+  if (tf->file == NULL) {
+    sys_sem_signal(drive_sema);
+    if (!tf->busy)
+      trackfile_free(tf);
+    return;
+  }
+  readahead_wake(tf);
+  sys_sem_signal(drive_sema);
+}
+
+/*
+ * Submit the queued read-ahead buffers to the command engine, one at a
+ * time so that drive_sema is not held while the drive is talked to.
+ * A buffer is only looked at while it is still queued, so ranges the
+ * reader has got past in the meantime are not read.  Runs in the gdrom
+ * thread.
+ */
+static void readahead_run(void)
+{
+  for (;;) {
+    trackfile_t *tf;
+    readahead_buf_t *rb = NULL;
+    int i, n = 0, secsize = 0, secmode = 0;
+    sys_sem_wait(drive_sema);
+    while ((tf = ra_queue) && !rb) {
+      secsize = tf->private->track.sectorsize;
+      secmode = tf->private->track.sectormode;
+      for (i=0; i<READAHEAD_BUFFERS && !rb; i++) {
+	cache_entry_t *e;
+	if (tf->buf[i].state != RA_QUEUED)
+	  continue;
+	rb = &tf->buf[i];
+	/* Take what we can from the cache, only read the rest */
+	for (n = 0; n < rb->num &&
+	       (e = cache_lookup(rb->sec + n, secsize, secmode)); n++)
+	  memcpy(rb->data + n * secsize, e->data, secsize);
+	if (n == rb->num) {
+	  rb->state = RA_READY;
+	  readahead_wake(tf);
+	  rb = NULL;
+	}
+      }
+      if (!rb) {
+	ra_queue = tf->ra_link;
+	tf->queued = 0;
+      }
+    }
+    if (rb) {
+      rb->state = RA_BUSY;
+      tf->busy++;
+      memset(&rb->cmd, 0, sizeof(rb->cmd));
+      rb->cmd.done = readahead_done;
+      rb->cmd.arg = rb;
+    }
+    sys_sem_signal(drive_sema);
+    if (!rb)
+      return;
+    submit_read(&rb->cmd, rb->sec + n, secsize, secmode,
+		rb->data + n * secsize, rb->num - n);
+  }
+}
+
+/*
+ * Tell the readers of files with newly completed buffers to try again.
+ * Runs in the gdrom thread.  The notify handler is called with the VFS
+ * lock held, so that the file can not be closed under it.
+ */
+static void readahead_wakeup(void)
+{
+  for (;;) {
+    trackfile_t *tf;
+    void (*notify)(void *) = NULL;
+    void *arg = NULL;
+    vfs_lock();
+    sys_sem_wait(drive_sema);
+    if ((tf = wake_queue)) {
+      wake_queue = tf->wake_link;
+      tf->woken = 0;
+      if (tf->file) {
+	notify = tf->file->notify;
+	arg = tf->file->notify_arg;
+      }
+    }
+    sys_sem_signal(drive_sema);
+    if (notify)
+      notify(arg);
+    vfs_unlock();
+    if (!tf)
+      return;
+  }
+}
+
+/*
+ * Read straight from the drive, for files that could not get read-ahead
+ * buffers.  Whole sectors go directly to dst, partial ones through a
+ * sector sized bounce buffer.  Returns bytes, or an error if not all
+ * of it could be read.
+ */
+static int tracknode_read_sync(gdrom_track_t *track, unsigned long posn,
+			       char *dst, size_t bytes)
+{
+  size_t done = 0;
+  while (done < bytes) {
+    int i, r, num = 1;
+    int sec = posn / track->sectorsize + track->start;
+    int offs = posn % track->sectorsize;
+    char *buf = dst, *bounce = NULL;
+    size_t n;
+    if (offs || bytes - done < (size_t)track->sectorsize) {
+      if (!(bounce = heap_alloc(HEAP_GDROM, track->sectorsize)))
+	return -ENOMEM;
+      buf = bounce;
+      n = track->sectorsize - offs;
+      if (n > bytes - done)
+	n = bytes - done;
+    } else {
+      num = (bytes - done) / track->sectorsize;
+      if (num > READAHEAD_SECTORS)
+	num = READAHEAD_SECTORS;
+      n = num * track->sectorsize;
+    }
+    r = read_sync(sec, track->sectorsize, track->sectormode, buf, num);
+    if (r >= 0) {
+      sys_sem_wait(drive_sema);
+      for (i=0; i<num; i++)
+	cache_insert(sec + i, track->sectorsize, track->sectormode,
+		     buf + i * track->sectorsize);
+      sys_sem_signal(drive_sema);
+      if (bounce)
+	memcpy(dst, bounce + offs, n);
+    }
+    heap_free(bounce);
+    if (r < 0)
+      return r;
+    dst += n;
+    posn += n;
+    done += n;
+  }
+  return done;
+}
+
+/*
+ * Copy what the read-ahead buffers hold at the current position.  If
+ * that is nothing, the missing sectors are queued and -EAGAIN returned;
+ * the file's notify handler is called once they have been read.  Files
+ * without read-ahead buffers are read synchronously instead.
+ */
 static int tracknode_read(vfsnode_t *node, vfs_file_t *file, void *buffer,
 			  size_t size, size_t nmemb)
 {
   tracknode_private_t *private = (tracknode_private_t *)node->private;
-  if (private) {
+  trackfile_t *tf = file->posp;
+  if (private && tf) {
     size_t bytes, cnt =
       (private->track.sectorsize * (private->track.end - private->track.start)
        - file->posn)/size;
@@ -168,59 +847,116 @@ static int tracknode_read(vfsnode_t *node, vfs_file_t *file, void *buffer,
       cnt = nmemb;
     bytes = cnt * size;
     if (bytes) {
-      int sec = file->posn / private->track.sectorsize + private->track.start;
-      int offs = file->posn % private->track.sectorsize;
-      int bl = bytes;
-      char buf[2352];
-      if (offs || bl < private->track.sectorsize) {
-	int r = read_sectors(sec, private->track.sectorsize,
-			     private->track.sectormode, buf, 1);
-	if (r<0)
-	  return r;
-	sec++;
-	if (offs + bl > private->track.sectorsize) {
-	  memcpy(buffer, buf+offs, private->track.sectorsize-offs);
-	  buffer = ((char *)buffer)+private->track.sectorsize-offs;
-	  bl -= private->track.sectorsize-offs;
-	} else {
-	  memcpy(buffer, buf+offs, bl);
-	  buffer = ((char *)buffer)+bl;
-	  bl = 0;
+      unsigned long posn = file->posn;
+      size_t left = bytes;
+      char *dst = buffer;
+      int r = 0;
+
+      sys_sem_wait(drive_sema);
+      if (posn != tf->next_posn)
+	readahead_reset(tf);
+      while (left) {
+	int sec = posn / private->track.sectorsize + private->track.start;
+	int offs = posn % private->track.sectorsize;
+	readahead_buf_t *rb = readahead_lookup(tf, sec);
+	size_t n;
+	if (!rb) {
+	  /* Not buffered for this file, but maybe someone else read it */
+	  cache_entry_t *e = cache_lookup(sec, private->track.sectorsize,
+					  private->track.sectormode);
+	  if (!e)
+	    break;
+	  n = private->track.sectorsize - offs;
+	  if (n > left)
+	    n = left;
+	  memcpy(dst, e->data + offs, n);
+	  dst += n;
+	  posn += n;
+	  left -= n;
+	  continue;
 	}
+	if (rb->state == RA_FAILED) {
+	  rb->state = RA_EMPTY;
+	  r = -EIO;
+	  break;
+	}
+	n = (rb->sec + rb->num - sec) * private->track.sectorsize - offs;
+	if (n > left)
+	  n = left;
+	memcpy(dst, rb->data + (sec - rb->sec) * private->track.sectorsize
+	       + offs, n);
+	dst += n;
+	posn += n;
+	left -= n;
       }
-      if (bl >= private->track.sectorsize) {
-	int sn = bl/private->track.sectorsize;
-	int r = read_sectors(sec, private->track.sectorsize,
-			     private->track.sectormode, buffer, sn);
-	if (r<0)
-	  return r;
-	sec += sn;
-	buffer = ((char *)buffer)+bl;
-	bl %= private->track.sectorsize;
-	buffer = ((char *)buffer)-bl;
-      }
-      if (bl) {
-	int r = read_sectors(sec, private->track.sectorsize,
-			     private->track.sectormode, buf, 1);
-	if (r<0)
-	  return r;
-	memcpy(buffer, buf, bl);
+      cnt = (bytes - left) / size;
+      posn = file->posn + cnt * size;
+      if (cnt && tf->seq < READAHEAD_TRIGGER)
+	tf->seq++;
+      tf->next_posn = posn;
+      if (r >= 0)
+	readahead_schedule(tf, posn, cnt < nmemb);
+      sys_sem_signal(drive_sema);
+      if (r >= 0 && !cnt && !tf->ra_mem) {
+	/* Out of memory for read-ahead, so do it the slow way */
+	if ((r = tracknode_read_sync(&private->track, posn, buffer,
+				     bytes)) >= 0) {
+	  cnt = bytes / size;
+	  posn = file->posn + cnt * size;
+	  tf->next_posn = posn;
+	}
       }
-      file->posn += bytes;
+      if (r<0 && !cnt)
+	return r;
+      if (!cnt)
+	return -EAGAIN;
+      file->posn = posn;
     }
     return cnt;
   } else
     return 0;
 }
 
+static int tracknode_seek(vfsnode_t *node, vfs_file_t *file,
+			  unsigned long offset)
+{
+  tracknode_private_t *private = (tracknode_private_t *)node->private;
+  trackfile_t *tf = file->posp;
+  if (!private || !tf || offset > private->track.sectorsize *
+      (private->track.end - private->track.start))
+    return -EINVAL;
+  if (offset != file->posn) {
+    sys_sem_wait(drive_sema);
+    readahead_reset(tf);
+    tf->next_posn = offset;
+    sys_sem_signal(drive_sema);
+    file->posn = offset;
+  }
+  return 0;
+}
+
+static int tracknode_eof(vfsnode_t *node, vfs_file_t *file)
+{
+  tracknode_private_t *private = (tracknode_private_t *)node->private;
+  if (private)
+    return file->posn >= private->track.sectorsize *
+      (private->track.end - private->track.start);
+  else
+    return 1;
+}
+
 static vfsnode_vtable_t tracknode_vtable = {
   .init = tracknode_init,
   .stat = tracknode_stat,
   .open = tracknode_open,
   .read = tracknode_read,
+  .eof = tracknode_eof,
+  .seek = tracknode_seek,
+  .close = tracknode_close,
 };
 
-static void make_vfsnodes_track(vfsnode_t *parent, int n, int t, int *param,
+static void make_vfsnodes_track(vfsnode_t *parent, int n, int t,
+				unsigned int *param,
 				unsigned int entry, unsigned int next)
 {
   char name[16];
@@ -237,7 +973,8 @@ static void make_vfsnodes_track(vfsnode_t *parent, int n, int t, int *param,
     vfsnode_mknode(parent, name, &tracknode_vtable, &track);
 }
 
-static void make_vfsnodes_session(vfsnode_t *parent, int n, int *param)
+static void make_vfsnodes_session(vfsnode_t *parent, int n,
+				  unsigned int *param)
 {
   int track;
 
@@ -266,6 +1003,9 @@ static void make_vfsnodes(void)
     return;
 
   curr_secsize = curr_secmode = -1;
+  sys_sem_wait(drive_sema);
+  cache_flush();
+  sys_sem_signal(drive_sema);
   
   for(i=0; i<2; i++) {
     struct { int session; void *buffer; } param;
@@ -280,8 +1020,9 @@ static void make_vfsnodes(void)
 
   gdGdcGetDrvStat(param);
 
+  gdrom_stats.discs++;
   vfs_lock();
-  root = vfsnode_mkvirtnode(NULL, "gdrom");
+  root = vfsnode_mksubtree(NULL, "gdrom");
   if (root != NULL)
     for(i=0; i<2; i++) {
       char name[16];
@@ -312,6 +1053,16 @@ static void gdrom_thread(void *arg)
 
   for(;;) {
     sys_mbox_fetch(mbox, &msg);
+    if (msg == MSG_READAHEAD) {
+      readahead_run();
+      continue;
+    } else if (msg == MSG_WAKEUP) {
+      readahead_wakeup();
+      continue;
+    } else if (msg == MSG_SYNCREAD) {
+      sync_run();
+      continue;
+    }
     state = (int)msg;
     if (state > 0 && state < 6) {
       if (root == NULL)
@@ -320,14 +1071,48 @@ static void gdrom_thread(void *arg)
       vfs_lock();
       vfsnode_destroy(root);
       root = NULL;
+      sys_sem_wait(drive_sema);
+      cache_flush();
+      sys_sem_signal(drive_sema);
       vfs_unlock();
     }
   }
 }
 
+static int gdrom_stats_gen(char *buf, size_t size)
+{
+  int len = 0;
+  unsigned long hits, misses, pct;
+  sys_sem_wait(drive_sema);
+  hits = cache_hits;
+  misses = cache_misses;
+  sys_sem_signal(drive_sema);
+  pct = (hits + misses? (unsigned long)((100ULL * hits) / (hits + misses)) : 0);
+  len = stats_printf(buf, size, len,
+		     "discs %lu\ncmds %lu\nerrors %lu\n"
+		     "datatype_switches %lu\n",
+		     gdrom_stats.discs, gdrom_stats.cmds, gdrom_stats.errors,
+		     gdrom_stats.datatype_switches);
+  len = stats_printf(buf, size, len,
+		     "reads %lu\nsectors %lu\nread_usec_avg %lu\n"
+		     "read_usec_max %lu\n",
+		     gdrom_stats.reads, gdrom_stats.sectors,
+		     (gdrom_stats.reads?
+		      stats_usec(gdrom_stats.read_ticks / gdrom_stats.reads) : 0),
+		     stats_usec(gdrom_stats.read_max));
+  len = stats_printf(buf, size, len,
+		     "cache_hits %lu\ncache_misses %lu\ncache_hit_pct %lu\n",
+		     hits, misses, pct);
+  return len;
+}
+
 void gdrom_be_init(void)
 {
   cdfs_init();
   mbox = sys_mbox_new();
+  drive_sema = sys_sem_new(1);
+  cmd_sema = sys_sem_new(0);
+  cache_init();
   sys_thread_new((void *)gdrom_thread, NULL);
+  stats_register("gdrom", gdrom_stats_gen);
 }
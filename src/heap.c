@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2012 Marcus Comstedt.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of the contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+
+#include "heap.h"
+#include "stats.h"
+
+/*
+ * Every block carries a small header with its size and tag, so that
+ * heap_free() can charge it back without being told.  Memory from
+ * these functions must only be released with heap_free().  Threads
+ * are cooperative, so the counters need no lock.
+ */
+typedef union heap_hdr_u {
+  struct {
+    size_t size;
+    int tag;
+  } h;
+  long long align;
+} heap_hdr_t;
+
+static struct {
+  unsigned long live, peak, allocs, frees, fails;
+} heap_stats[HEAP_NTAGS];
+
+static const char *heap_names[HEAP_NTAGS] = {
+  "ftpd", "vfs", "vfsnode", "arena", "gdrom",
+};
+
+static void *heap_charge(int tag, heap_hdr_t *hdr, size_t size)
+{
+  if (!hdr) {
+    heap_stats[tag].fails++;
+    return NULL;
+  }
+  hdr->h.size = size;
+  hdr->h.tag = tag;
+  heap_stats[tag].allocs++;
+  if ((heap_stats[tag].live += size) > heap_stats[tag].peak)
+    heap_stats[tag].peak = heap_stats[tag].live;
+  return hdr + 1;
+}
+
+void *heap_alloc(int tag, size_t size)
+{
+  return heap_charge(tag, malloc(sizeof(heap_hdr_t) + size), size);
+}
+
+void *heap_calloc(int tag, size_t n, size_t size)
+{
+  return heap_charge(tag, calloc(1, sizeof(heap_hdr_t) + n * size),
+		     n * size);
+}
+
+void *heap_realloc(int tag, void *ptr, size_t size)
+{
+  heap_hdr_t *hdr;
+  if (!ptr)
+    return heap_alloc(tag, size);
+  hdr = ((heap_hdr_t *)ptr) - 1;
+  if (!(ptr = realloc(hdr, sizeof(heap_hdr_t) + size))) {
+    heap_stats[hdr->h.tag].fails++;
+    return NULL;
+  }
+  hdr = ptr;
+  heap_stats[hdr->h.tag].live -= hdr->h.size;
+  heap_stats[hdr->h.tag].frees++;
+  return heap_charge(hdr->h.tag, hdr, size);
+}
+
+char *heap_strdup(int tag, const char *s)
+{
+  size_t len = strlen(s) + 1;
+  char *r = heap_alloc(tag, len);
+  if (r)
+    memcpy(r, s, len);
+  return r;
+}
+
+void heap_free(void *ptr)
+{
+  heap_hdr_t *hdr;
+  if (!ptr)
+    return;
+  hdr = ((heap_hdr_t *)ptr) - 1;
+  heap_stats[hdr->h.tag].live -= hdr->h.size;
+  heap_stats[hdr->h.tag].frees++;
+  free(hdr);
+}
+
+int heap_report(char *buf, size_t size)
+{
+  int i, len = 0;
+#ifdef HOST
+  /* glibc has deprecated mallinfo() for mallinfo2() */
+  struct mallinfo2 mi = mallinfo2();
+#else
+  struct mallinfo mi = mallinfo();
+#endif
+  len = stats_printf(buf, size, len, "%-8s %9s %9s %9s %9s %5s\n",
+		     "tag", "live", "peak", "allocs", "frees", "fails");
+  for (i = 0; i < HEAP_NTAGS; i++)
+    len = stats_printf(buf, size, len, "%-8s %9lu %9lu %9lu %9lu %5lu\n",
+		       heap_names[i], heap_stats[i].live, heap_stats[i].peak,
+		       heap_stats[i].allocs, heap_stats[i].frees,
+		       heap_stats[i].fails);
+  len = stats_printf(buf, size, len, "malloc arena %lu, in use %lu\n",
+		     (unsigned long)mi.arena, (unsigned long)mi.uordblks);
+  return len;
+}
@@ -0,0 +1,665 @@
+/*
+ * Copyright (c) 2012 Marcus Comstedt.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of the contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <math.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <ronin/gddrive.h>
+#include <ronin/cdfs.h>
+#include "host.h"
+
+/*
+ * GD-ROM drive simulator behind the gdGdc* calls that gdrom.c makes.
+ *
+ * The disc comes from a .gdi, a .cue with its .bin files, or a plain
+ * .iso, named by DCFTPD_DISC.  Commands take as long as they would on
+ * a drive: a fixed overhead per command, the cost of a data type
+ * switch, a seek that grows with the square root of the head travel,
+ * rotational latency, and a transfer rate that grows with the radius
+ * as on a CAV drive.  A read that picks up where the last one ended
+ * skips the seek, but has to wait for the sector to come around again
+ * if it was issued too late.  Rotational latency is otherwise drawn
+ * from a fixed seed, so a run can be repeated.
+ *
+ * The tray can be opened and closed on a schedule given in GDSIM_TRAY,
+ * as a list of "seconds:open" and "seconds:close[=image]" events
+ * counted from cdfs_init(), or toggled with SIGUSR1.  After the tray
+ * closes the drive spins up, and then fails everything but the init
+ * command (24) with a disc change error until it has been sent.
+ */
+
+/* Model parameters, times in microseconds */
+#ifndef GDSIM_CMD_USEC
+#define GDSIM_CMD_USEC 300
+#endif
+#ifndef GDSIM_DATATYPE_USEC
+#define GDSIM_DATATYPE_USEC 2000
+#endif
+#ifndef GDSIM_SEEK_MIN_USEC
+#define GDSIM_SEEK_MIN_USEC 2000
+#endif
+#ifndef GDSIM_SEEK_FULL_USEC
+#define GDSIM_SEEK_FULL_USEC 180000
+#endif
+#ifndef GDSIM_SPINUP_USEC
+#define GDSIM_SPINUP_USEC 1500000
+#endif
+#ifndef GDSIM_RPM
+#define GDSIM_RPM 4800
+#endif
+/* Sectors per revolution at the innermost and outermost LBA */
+#ifndef GDSIM_SECTORS_INNER
+#define GDSIM_SECTORS_INNER 9
+#endif
+#ifndef GDSIM_SECTORS_OUTER
+#define GDSIM_SECTORS_OUTER 21
+#endif
+#ifndef GDSIM_SEED
+#define GDSIM_SEED 1
+#endif
+
+/* LBAs that the radius is spread over, a full GD-ROM */
+#define DISC_LBAS     549150
+#define DISC_PREGAP   150
+/* Where the high density area, and so the second session, begins */
+#define GD_HD_LBA     45000
+#define REV_USEC      (60000000ULL / GDSIM_RPM)
+
+#define MAX_TRACKS    99
+#define MAX_SCHEDULE  16
+
+/* gdGdcGetCmdStat() results */
+#define CMD_NONE       0
+#define CMD_BUSY       1
+#define CMD_DONE       2
+#define CMD_FAILED    -1
+
+/* Error codes, as gdrom.c maps them */
+#define ERR_NODISC     2
+#define ERR_CHANGED    6
+#define ERR_ILLEGAL    5
+
+/* Drive states */
+#define DRV_BUSY       0
+#define DRV_PAUSE      1
+#define DRV_OPEN       6
+#define DRV_NODISC     7
+
+typedef struct gdsim_track_s {
+  int lba, sectors;		/* without the 150 sector pregap */
+  int ctrl, secsize, session;
+  int fd;
+  off_t offset;
+} gdsim_track_t;
+
+static gdsim_track_t tracks[MAX_TRACKS];
+static int ntracks = 0, disctype = 0;
+
+static struct {
+  double when;
+  int open;
+  char *image;
+} schedule[MAX_SCHEDULE];
+static int nschedule = 0, next_event = 0;
+
+static volatile sig_atomic_t tray_toggle = 0;
+static int tray_open = 0, unit_attention = 0;
+static unsigned long long epoch, ready_at = 0;
+
+static int secsize = 2048, secmode = 1024, datatype_pending = 0;
+static int head_sec = 0;
+static unsigned long long head_time = 0;
+static unsigned int seed = GDSIM_SEED;
+
+static struct {
+  int handle, cmd, busy, error;
+  unsigned long long done_at;
+  int sec, num, session;
+  void *buffer;
+} cur;
+
+static unsigned long long now_usec(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Images
+ */
+
+static void unload(void)
+{
+  int i, j;
+  for (i = 0; i < ntracks; i++) {
+    for (j = 0; j < i; j++)
+      if (tracks[j].fd == tracks[i].fd)
+	break;
+    if (j == i && tracks[i].fd >= 0)
+      close(tracks[i].fd);
+  }
+  ntracks = 0;
+  disctype = 0;
+}
+
+/* Open a file named in an image, relative to the image */
+static int open_rel(const char *image, const char *name, off_t *size)
+{
+  char path[1024];
+  const char *slash = strrchr(image, '/');
+  struct stat st;
+  int fd;
+  if (name[0] != '/' && slash)
+    snprintf(path, sizeof(path), "%.*s/%s", (int)(slash - image), image, name);
+  else
+    snprintf(path, sizeof(path), "%s", name);
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return -1;
+  if (fstat(fd, &st)) {
+    close(fd);
+    return -1;
+  }
+  *size = st.st_size;
+  return fd;
+}
+
+/* Next whitespace separated word, which may be quoted */
+static char *word(char **p)
+{
+  char *s = *p, *w;
+  while (isspace((unsigned char)*s))
+    s++;
+  if (!*s)
+    return NULL;
+  if (*s == '"') {
+    w = ++s;
+    while (*s && *s != '"')
+      s++;
+  } else {
+    w = s;
+    while (*s && !isspace((unsigned char)*s))
+      s++;
+  }
+  if (*s)
+    *s++ = '\0';
+  *p = s;
+  return w;
+}
+
+static int load_iso(const char *image)
+{
+  gdsim_track_t *t = &tracks[0];
+  off_t size;
+  if ((t->fd = open_rel(image, image, &size)) < 0)
+    return -1;
+  t->lba = 0;
+  t->sectors = size / 2048;
+  t->ctrl = 4;
+  t->secsize = 2048;
+  t->session = 0;
+  t->offset = 0;
+  ntracks = 1;
+  disctype = 0x10;
+  return 0;
+}
+
+/* Lines of "track lba ctrl secsize file offset" after a track count */
+static int load_gdi(const char *image)
+{
+  char line[1024];
+  FILE *f = fopen(image, "r");
+  if (!f)
+    return -1;
+  if (!fgets(line, sizeof(line), f)) {
+    fclose(f);
+    return -1;
+  }
+  while (ntracks < MAX_TRACKS && fgets(line, sizeof(line), f)) {
+    gdsim_track_t *t = &tracks[ntracks];
+    char *p = line, *w[6];
+    off_t size;
+    int i;
+    for (i = 0; i < 6 && (w[i] = word(&p)); i++)
+      ;
+    if (i < 6)
+      continue;
+    t->lba = atoi(w[1]);
+    t->ctrl = atoi(w[2]);
+    t->secsize = atoi(w[3]);
+    t->offset = atol(w[5]);
+    t->session = (t->lba >= GD_HD_LBA);
+    if (t->secsize != 2048 && t->secsize != 2352)
+      break;
+    if ((t->fd = open_rel(image, w[4], &size)) < 0)
+      break;
+    t->sectors = (size - t->offset) / t->secsize;
+    ntracks++;
+  }
+  fclose(f);
+  disctype = 0x80;
+  return (ntracks? 0 : -1);
+}
+
+static int msf(const char *s)
+{
+  int m = 0, sec = 0, fr = 0;
+  sscanf(s, "%d:%d:%d", &m, &sec, &fr);
+  return (m * 60 + sec) * 75 + fr;
+}
+
+/*
+ * A .cue describes one session.  Each track starts at its INDEX 01;
+ * pregap sectors that are in the file (INDEX 00) stay with the track
+ * before, and PREGAP ones that are not move the rest of the disc on.
+ */
+static int load_cue(const char *image)
+{
+  char line[1024];
+  int fidx[MAX_TRACKS];
+  int fd = -1, base = 0, gap = 0, first = 0, xa = 0, audio = 1;
+  off_t size = 0;
+  gdsim_track_t *t = NULL;
+  FILE *f = fopen(image, "r");
+  if (!f)
+    return -1;
+  while (fgets(line, sizeof(line), f)) {
+    char *p = line, *cmd = word(&p), *arg;
+    if (!cmd)
+      continue;
+    if (!strcasecmp(cmd, "FILE") && (arg = word(&p))) {
+      if (fd >= 0)
+	base += size / (t? t->secsize : 2352);
+      if ((fd = open_rel(image, arg, &size)) < 0)
+	break;
+      first = ntracks;
+    } else if (!strcasecmp(cmd, "TRACK") && fd >= 0 &&
+	       ntracks < MAX_TRACKS && word(&p) && (arg = word(&p))) {
+      t = &tracks[ntracks];
+      t->fd = fd;
+      t->session = 0;
+      t->lba = -1;
+      if (!strcasecmp(arg, "AUDIO")) {
+	t->ctrl = 0;
+	t->secsize = 2352;
+      } else {
+	t->ctrl = 4;
+	t->secsize = (strstr(arg, "/2048")? 2048 : 2352);
+	audio = 0;
+	if (!strncasecmp(arg, "MODE2", 5))
+	  xa = 1;
+      }
+    } else if (!strcasecmp(cmd, "PREGAP") && t && (arg = word(&p))) {
+      gap += msf(arg);
+    } else if (!strcasecmp(cmd, "INDEX") && t && t->lba < 0 &&
+	       (arg = word(&p)) && atoi(arg) == 1 && (arg = word(&p))) {
+      int idx = msf(arg);
+      if (ntracks > first) {
+	gdsim_track_t *prev = t - 1;
+	prev->sectors = idx - fidx[ntracks - 1];
+	t->offset = prev->offset + (off_t)prev->sectors * prev->secsize;
+      } else
+	t->offset = (off_t)idx * t->secsize;
+      fidx[ntracks] = idx;
+      t->lba = base + gap + idx;
+      t->sectors = (size - t->offset) / t->secsize;
+      ntracks++;
+    }
+  }
+  fclose(f);
+  disctype = (audio? 0x00 : (xa? 0x20 : 0x10));
+  return (ntracks? 0 : -1);
+}
+
+static int load(const char *image)
+{
+  const char *ext = strrchr(image, '.');
+  int r;
+  unload();
+  if (ext && !strcasecmp(ext, ".gdi"))
+    r = load_gdi(image);
+  else if (ext && !strcasecmp(ext, ".cue"))
+    r = load_cue(image);
+  else
+    r = load_iso(image);
+  if (r < 0)
+    unload();
+  return r;
+}
+
+/*
+ * Tray
+ */
+
+static void tray_signal(int sig)
+{
+  tray_toggle = 1;
+}
+
+static void parse_schedule(const char *s)
+{
+  while (s && *s && nschedule < MAX_SCHEDULE) {
+    const char *end = strchr(s, ','), *colon = strchr(s, ':');
+    int len = (end? end - s : strlen(s));
+    if (colon && colon < s + len) {
+      schedule[nschedule].when = atof(s);
+      schedule[nschedule].open = !strncmp(colon + 1, "open", 4);
+      schedule[nschedule].image = NULL;
+      if (!schedule[nschedule].open) {
+	const char *eq = memchr(colon, '=', s + len - colon);
+	if (eq)
+	  schedule[nschedule].image = strndup(eq + 1, s + len - eq - 1);
+      }
+      nschedule++;
+    }
+    s = (end? end + 1 : NULL);
+  }
+}
+
+static void set_tray(int open, const char *image, unsigned long long now)
+{
+  if (open == tray_open)
+    return;
+  tray_open = open;
+  if (open) {
+    if (cur.busy) {
+      cur.busy = 0;
+      cur.error = ERR_CHANGED;
+    }
+  } else {
+    if (image)
+      load(image);
+    ready_at = now + GDSIM_SPINUP_USEC;
+    unit_attention = 1;
+    head_sec = 0;
+    head_time = 0;
+  }
+}
+
+/* Bring the drive up to date with the clock */
+static void update(void)
+{
+  unsigned long long now = now_usec();
+  if (tray_toggle) {
+    tray_toggle = 0;
+    set_tray(!tray_open, NULL, now);
+  }
+  while (next_event < nschedule &&
+	 now >= epoch + (unsigned long long)(schedule[next_event].when * 1e6)) {
+    set_tray(schedule[next_event].open, schedule[next_event].image, now);
+    next_event++;
+  }
+}
+
+/*
+ * Timing
+ */
+
+/* Radius as a fraction of the way out, for equal area per sector */
+static double radius(int sec)
+{
+  double r0 = GDSIM_SECTORS_INNER, r1 = GDSIM_SECTORS_OUTER;
+  double a = (double)(sec < 0? 0 : sec) / DISC_LBAS;
+  double r = sqrt(r0 * r0 + a * (r1 * r1 - r0 * r0));
+  return (r - r0) / (r1 - r0);
+}
+
+static unsigned long long seek_usec(int from, int to)
+{
+  double d = fabs(radius(to) - radius(from));
+  return GDSIM_SEEK_MIN_USEC +
+    (unsigned long long)((GDSIM_SEEK_FULL_USEC - GDSIM_SEEK_MIN_USEC) *
+			 sqrt(d));
+}
+
+static unsigned long long transfer_usec(int sec, int num)
+{
+  double spr = GDSIM_SECTORS_INNER +
+    radius(sec + num / 2) * (GDSIM_SECTORS_OUTER - GDSIM_SECTORS_INNER);
+  return (unsigned long long)(num * REV_USEC / spr);
+}
+
+static unsigned long long rotation_usec(int sec, unsigned long long start)
+{
+  if (sec == head_sec && head_time) {
+    unsigned long long late = (start - head_time) % REV_USEC;
+    return (late? REV_USEC - late : 0);
+  }
+  seed = seed * 1103515245 + 12345;
+  return (seed >> 8) % REV_USEC;
+}
+
+/*
+ * Commands
+ */
+
+static gdsim_track_t *find_track(int sec)
+{
+  int i;
+  for (i = 0; i < ntracks; i++)
+    if (sec >= tracks[i].lba + DISC_PREGAP &&
+	sec < tracks[i].lba + DISC_PREGAP + tracks[i].sectors)
+      return &tracks[i];
+  return NULL;
+}
+
+static int read_sector(int sec, char *buffer)
+{
+  gdsim_track_t *t = find_track(sec);
+  char raw[2352];
+  int i, skip = 0;
+  if (!t) {
+    /* Gaps between tracks are left out of images; they read as zeros */
+    for (i = 0; i < ntracks; i++)
+      if (sec >= DISC_PREGAP && sec < tracks[i].lba + DISC_PREGAP) {
+	memset(buffer, 0, secsize);
+	return 0;
+      }
+    return ERR_ILLEGAL;
+  }
+  if (secsize == 2048) {
+    if (!(t->ctrl & 4))
+      return ERR_ILLEGAL;
+  } else if (t->secsize != secsize)
+    return ERR_ILLEGAL;
+  if (pread(t->fd, raw, t->secsize, t->offset + (off_t)t->secsize *
+	    (sec - t->lba - DISC_PREGAP)) != t->secsize)
+    return ERR_ILLEGAL;
+  /* User data follows the header, and for mode 2 the subheader */
+  if (t->secsize == 2352 && secsize == 2048)
+    skip = (raw[15] == 2? 24 : 16);
+  memcpy(buffer, raw + skip, secsize);
+  return 0;
+}
+
+static int read_toc(int session, struct TOC *toc)
+{
+  gdsim_track_t *last = NULL;
+  int i, first = 0;
+  memset(toc, 0xff, sizeof(*toc));
+  for (i = 0; i < ntracks; i++)
+    if (tracks[i].session == session) {
+      unsigned int ctrl_adr = (tracks[i].ctrl << 28) | (1 << 24);
+      toc->entry[i] = ctrl_adr | (tracks[i].lba + DISC_PREGAP);
+      if (!first)
+	toc->first = ctrl_adr | ((first = i + 1) << 16);
+      toc->last = ctrl_adr | ((i + 1) << 16);
+      last = &tracks[i];
+    }
+  if (!last)
+    return ERR_ILLEGAL;
+  toc->dunno = (last->ctrl << 28) | (1 << 24) |
+    (last->lba + last->sectors + DISC_PREGAP);
+  return 0;
+}
+
+static void complete(void)
+{
+  int i;
+  cur.busy = 0;
+  switch (cur.cmd) {
+  case 16:
+    for (i = 0; i < cur.num && !cur.error; i++)
+      cur.error = read_sector(cur.sec + i, (char *)cur.buffer + i * secsize);
+    break;
+  case 19:
+    cur.error = read_toc(cur.session, cur.buffer);
+    break;
+  }
+}
+
+void cdfs_init(void)
+{
+  epoch = now_usec();
+  signal(SIGUSR1, tray_signal);
+  parse_schedule(getenv("GDSIM_TRAY"));
+  load(host_image("DCFTPD_DISC", HOST_DISC_IMAGE));
+  unit_attention = 1;
+  ready_at = epoch + GDSIM_SPINUP_USEC;
+}
+
+int gdGdcReqCmd(int cmd, void *param)
+{
+  unsigned long long now, start;
+  int handle = cur.handle;
+  update();
+  if (cur.busy)
+    return 0;
+  now = now_usec();
+  memset(&cur, 0, sizeof(cur));
+  cur.handle = (handle + 1) & 0x7fffffff;
+  if (!cur.handle)
+    cur.handle = 1;
+  cur.cmd = cmd;
+  cur.busy = 1;
+  start = (now > ready_at? now : ready_at) + GDSIM_CMD_USEC;
+  if (tray_open || !ntracks)
+    cur.error = ERR_NODISC;
+  else if (unit_attention && cmd != 24)
+    cur.error = ERR_CHANGED;
+  else
+    switch (cmd) {
+    case 16: {
+      struct { int sec, num; void *buffer; int dunno; } *p = param;
+      cur.sec = p->sec;
+      cur.num = p->num;
+      cur.buffer = p->buffer;
+      if (datatype_pending) {
+	start += GDSIM_DATATYPE_USEC;
+	datatype_pending = 0;
+      }
+      if (cur.sec != head_sec || !head_time)
+	start += seek_usec(head_sec, cur.sec);
+      start += rotation_usec(cur.sec, start);
+      start += transfer_usec(cur.sec, cur.num);
+      head_sec = cur.sec + cur.num;
+      head_time = start;
+      break;
+    }
+    case 19: {
+      struct { int session; void *buffer; } *p = param;
+      cur.session = p->session;
+      cur.buffer = p->buffer;
+      break;
+    }
+    case 24:
+      unit_attention = 0;
+      break;
+    default:
+      cur.error = ERR_ILLEGAL;
+      break;
+    }
+  cur.done_at = start;
+  return cur.handle;
+}
+
+int gdGdcGetCmdStat(int f, void *status)
+{
+  int *s = status;
+  update();
+  memset(s, 0, 4 * sizeof(int));
+  if (!f || f != cur.handle)
+    return CMD_NONE;
+  if (cur.busy)
+    return CMD_BUSY;
+  if (cur.error) {
+    s[0] = cur.error;
+    return CMD_FAILED;
+  }
+  return CMD_DONE;
+}
+
+void gdGdcExecServer(void)
+{
+  update();
+  if (cur.busy && now_usec() >= cur.done_at) {
+    if (!cur.error)
+      complete();
+    cur.busy = 0;
+  }
+}
+
+int gdGdcGetDrvStat(void *param)
+{
+  unsigned int *p = param;
+  update();
+  if (tray_open)
+    p[0] = DRV_OPEN;
+  else if (!ntracks)
+    p[0] = DRV_NODISC;
+  else if (now_usec() < ready_at)
+    p[0] = DRV_BUSY;
+  else
+    p[0] = DRV_PAUSE;
+  p[1] = (tray_open? 0 : disctype);
+  return 0;
+}
+
+int gdGdcChangeDataType(void *param)
+{
+  unsigned int *p = param;
+  if (p[3] != 2048 && p[3] != 2352)
+    return -1;
+  if (p[3] != secsize || p[2] != secmode)
+    datatype_pending = 1;
+  secsize = p[3];
+  secmode = p[2];
+  return 0;
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2012 Marcus Comstedt.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of the contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Glue between the host stand-ins.  Only host/ and the HOST parts of
+ * the backends include this.
+ */
+
+#ifndef __HOST_H__
+#define __HOST_H__
+
+#include <stddef.h>
+
+/* Image files, overridable from the environment */
+#define HOST_FLASH_IMAGE "flash.bin"
+#define HOST_ROM_IMAGE   "rom.bin"
+#define HOST_DISC_IMAGE  "disc.iso"
+
+/* sys_arch.c */
+unsigned long long host_msec(void);
+void host_lock(void);
+void host_unlock(void);
+int host_next_timeout(void);
+void host_run_timeouts(void);
+
+/* sockets.c */
+void host_sockets_init(void);
+void host_loop(void);
+
+/* images.c */
+const char *host_image(const char *var, const char *def);
+int host_flash_info(int sect, int *info);
+int host_flash_read(int offs, void *buf, int cnt);
+const void *host_rom(size_t *size);
+
+/* gdsim.c provides the gdGdc* calls in ronin/gddrive.h */
+
+#endif				/* __HOST_H__ */
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2012 Marcus Comstedt.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of the contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "host.h"
+
+/*
+ * Stand-ins for the console's flash and ROM, served from image
+ * files; the GD-ROM drive is simulated by gdsim.c.  Each image is
+ * looked up through an environment variable, falling back to a file
+ * in the current directory.  A missing image just makes the
+ * corresponding tree empty.
+ */
+
+const char *host_image(const char *var, const char *def)
+{
+  const char *path = getenv(var);
+  return (path && *path? path : def);
+}
+
+/*
+ * Flash.  The image is a dump of the whole 128K flash, and the
+ * partitions are where the BIOS puts them.
+ */
+
+static const int flash_partitions[][2] = {
+  { 0x1a000, 0x2000 },
+  { 0x18000, 0x2000 },
+  { 0x1c000, 0x4000 },
+  { 0x10000, 0x8000 },
+  { 0x00000, 0x10000 },
+};
+
+static int flash_fd = -2;
+static off_t flash_size = 0;
+
+static int flash_open(void)
+{
+  if (flash_fd == -2) {
+    struct stat st;
+    flash_fd = open(host_image("DCFTPD_FLASH", HOST_FLASH_IMAGE), O_RDONLY);
+    if (flash_fd >= 0 && !fstat(flash_fd, &st))
+      flash_size = st.st_size;
+  }
+  return flash_fd;
+}
+
+int host_flash_info(int sect, int *info)
+{
+  if (flash_open() < 0 || sect < 0 ||
+      sect >= sizeof(flash_partitions)/sizeof(flash_partitions[0]) ||
+      flash_partitions[sect][0] + flash_partitions[sect][1] > flash_size)
+    return -1;
+  info[0] = flash_partitions[sect][0];
+  info[1] = flash_partitions[sect][1];
+  return 0;
+}
+
+int host_flash_read(int offs, void *buf, int cnt)
+{
+  if (flash_open() < 0 || pread(flash_fd, buf, cnt, offs) != cnt)
+    return -1;
+  return cnt;
+}
+
+/*
+ * ROM.  Mapped rather than read, as the console side hands out
+ * pointers into it.
+ */
+
+const void *host_rom(size_t *size)
+{
+  struct stat st;
+  void *rom;
+  int fd = open(host_image("DCFTPD_ROM", HOST_ROM_IMAGE), O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &st) || !st.st_size ||
+      (rom = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+      MAP_FAILED) {
+    close(fd);
+    return NULL;
+  }
+  close(fd);
+  *size = st.st_size;
+  return rom;
+}
@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2012 Marcus Comstedt.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of the contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Host stand-in for the lwIP raw TCP API.  Only what ftpd.c uses is
+ * provided, on top of non-blocking BSD sockets; see host/sockets.c.
+ */
+
+#ifndef __HOST_LWIP_TCP_H__
+#define __HOST_LWIP_TCP_H__
+
+#include <stddef.h>
+#include <arpa/inet.h>
+
+#include "lwip/sys.h"
+
+typedef s8_t err_t;
+
+#define ERR_OK    0
+#define ERR_MEM  -1
+#define ERR_BUF  -2
+#define ERR_ABRT -3
+#define ERR_RST  -4
+#define ERR_CLSD -5
+#define ERR_CONN -6
+#define ERR_VAL  -7
+#define ERR_ARG  -8
+#define ERR_RTE  -9
+#define ERR_USE  -10
+
+char *lwip_strerr(err_t err);
+
+/* Addresses are kept in network byte order, as lwIP does */
+struct ip_addr {
+  u32_t addr;
+};
+
+extern struct ip_addr ip_addr_any;
+#define IP_ADDR_ANY (&ip_addr_any)
+
+#define IP4_ADDR(ipaddr, a,b,c,d) \
+  ((ipaddr)->addr = htonl(((u32_t)((a) & 0xff) << 24) | \
+			  ((u32_t)((b) & 0xff) << 16) | \
+			  ((u32_t)((c) & 0xff) << 8) | \
+			  (u32_t)((d) & 0xff)))
+#define ip4_addr1(ipaddr) ((u16_t)(ntohl((ipaddr)->addr) >> 24) & 0xff)
+#define ip4_addr2(ipaddr) ((u16_t)(ntohl((ipaddr)->addr) >> 16) & 0xff)
+#define ip4_addr3(ipaddr) ((u16_t)(ntohl((ipaddr)->addr) >> 8) & 0xff)
+#define ip4_addr4(ipaddr) ((u16_t)(ntohl((ipaddr)->addr)) & 0xff)
+#define ip_addr_cmp(addr1, addr2) ((addr1)->addr == (addr2)->addr)
+
+struct pbuf {
+  struct pbuf *next;
+  void *payload;
+  u16_t tot_len, len;
+  u16_t ref;
+};
+
+u8_t pbuf_free(struct pbuf *p);
+void pbuf_ref(struct pbuf *p);
+void pbuf_chain(struct pbuf *h, struct pbuf *t);
+
+/* Sized like a stock lwIP configuration; override with -D */
+#ifndef TCP_MSS
+#define TCP_MSS 1460
+#endif
+#ifndef TCP_SND_BUF
+#define TCP_SND_BUF (4 * TCP_MSS)
+#endif
+#ifndef TCP_WND
+#define TCP_WND (4 * TCP_MSS)
+#endif
+
+enum tcp_state {
+  CLOSED, LISTEN, SYN_SENT, SYN_RCVD, ESTABLISHED, FIN_WAIT_1, FIN_WAIT_2,
+  CLOSE_WAIT, CLOSING, LAST_ACK, TIME_WAIT
+};
+
+/*
+ * The kernel does not show its segment queues, so unsent and unacked
+ * are a single placeholder segment each, set while there are bytes
+ * buffered here or handed to the kernel but not yet reported sent.
+ */
+struct tcp_seg {
+  struct tcp_seg *next;
+};
+
+struct tcp_pcb {
+  /* The fields ftpd.c looks at, with the lwIP names */
+  struct ip_addr local_ip, remote_ip;
+  u16_t local_port, remote_port;
+  enum tcp_state state;
+  struct tcp_seg *unsent, *unacked;
+  u16_t mss, snd_buf, snd_queuelen;
+  u32_t snd_wnd, cwnd, ssthresh;
+  s16_t sa, sv;			/* smoothed RTT and variance, in ms */
+  u8_t nrtx;
+
+  /* Socket side, private to host/sockets.c */
+  struct tcp_pcb *next;
+  int fd, connecting, closed, dead, eof;
+  void *callback_arg;
+  err_t (*accept)(void *arg, struct tcp_pcb *newpcb, err_t err);
+  err_t (*connected)(void *arg, struct tcp_pcb *pcb, err_t err);
+  err_t (*recv)(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err);
+  err_t (*sent)(void *arg, struct tcp_pcb *pcb, u16_t len);
+  void (*errf)(void *arg, err_t err);
+  err_t (*poll)(void *arg, struct tcp_pcb *pcb);
+  u8_t pollinterval;
+  unsigned long long next_poll;
+  unsigned int rcv_wnd, snd_head, snd_len, snd_acked;
+  char *snd_data;
+};
+
+#define tcp_sndbuf(pcb) ((pcb)->snd_buf)
+#define tcp_mss(pcb) ((pcb)->mss)
+
+struct tcp_pcb *tcp_new(void);
+err_t tcp_bind(struct tcp_pcb *pcb, struct ip_addr *ipaddr, u16_t port);
+struct tcp_pcb *tcp_listen(struct tcp_pcb *pcb);
+err_t tcp_connect(struct tcp_pcb *pcb, struct ip_addr *ipaddr, u16_t port,
+		  err_t (*connected)(void *arg, struct tcp_pcb *tpcb,
+				     err_t err));
+err_t tcp_write(struct tcp_pcb *pcb, const void *dataptr, u16_t len,
+		u8_t copy);
+err_t tcp_output(struct tcp_pcb *pcb);
+void tcp_recved(struct tcp_pcb *pcb, u16_t len);
+err_t tcp_close(struct tcp_pcb *pcb);
+void tcp_abort(struct tcp_pcb *pcb);
+
+void tcp_arg(struct tcp_pcb *pcb, void *arg);
+void tcp_accept(struct tcp_pcb *pcb,
+		err_t (*accept)(void *arg, struct tcp_pcb *newpcb, err_t err));
+void tcp_recv(struct tcp_pcb *pcb,
+	      err_t (*recv)(void *arg, struct tcp_pcb *tpcb,
+			    struct pbuf *p, err_t err));
+void tcp_sent(struct tcp_pcb *pcb,
+	      err_t (*sent)(void *arg, struct tcp_pcb *tpcb, u16_t len));
+void tcp_err(struct tcp_pcb *pcb, void (*errf)(void *arg, err_t err));
+void tcp_poll(struct tcp_pcb *pcb,
+	      err_t (*poll)(void *arg, struct tcp_pcb *tpcb), u8_t interval);
+
+#endif				/* __HOST_LWIP_TCP_H__ */
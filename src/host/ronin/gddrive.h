@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2012 Marcus Comstedt.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of the contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The part of the libronin GD-ROM driver interface used by gdrom.c.
+ * On the host it is simulated by host/gdsim.c.
+ */
+
+#ifndef __HOST_RONIN_GDDRIVE_H__
+#define __HOST_RONIN_GDDRIVE_H__
+
+struct TOC {
+  unsigned int entry[99];
+  unsigned int first, last;
+  unsigned int dunno;
+};
+
+#define TOC_LBA(n) ((n)&0x00ffffff)
+#define TOC_ADR(n) (((n)&0x0f000000)>>24)
+#define TOC_CTRL(n) (((n)&0xf0000000)>>28)
+#define TOC_TRACK(n) (((n)&0x00ff0000)>>16)
+
+int gdGdcReqCmd(int cmd, void *param);
+int gdGdcGetCmdStat(int f, void *status);
+void gdGdcExecServer(void);
+int gdGdcGetDrvStat(void *param);
+int gdGdcChangeDataType(void *param);
+
+#endif				/* __HOST_RONIN_GDDRIVE_H__ */
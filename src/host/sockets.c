@@ -0,0 +1,616 @@
+/*
+ * Copyright (c) 2012 Marcus Comstedt.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of the contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <lwip/tcp.h>
+#include "host.h"
+
+/*
+ * The raw TCP API on top of non-blocking sockets, driven from the
+ * main thread by host_loop().  Written data is kept here until the
+ * kernel takes it, and what the kernel has taken is reported back
+ * through the sent callback from the loop, never from within the
+ * call that wrote it, as lwIP does.  The kernel send buffer is kept
+ * at TCP_SND_BUF so that the server sees roughly the flow control
+ * it gets on the console.
+ *
+ * pcbs that are closed or aborted are only freed by the loop, once
+ * no callback can be holding on to them.
+ */
+
+#define TCP_SLOW_INTERVAL 500
+
+struct ip_addr ip_addr_any = { INADDR_ANY };
+
+static struct tcp_pcb *pcbs = NULL;
+static struct tcp_seg seg_placeholder = { NULL };
+static int wake_fds[2] = { -1, -1 };
+static int wake_pending = 0;
+
+static const char *err_strerr[] = {
+  "Ok.", "Out of memory error.", "Buffer error.", "Connection aborted.",
+  "Connection reset.", "Connection closed.", "Not connected.",
+  "Illegal value.", "Illegal argument.", "Routing problem.",
+  "Address in use."
+};
+
+char *lwip_strerr(err_t err)
+{
+  if (err > 0 || -err >= sizeof(err_strerr)/sizeof(err_strerr[0]))
+    return "Unknown error.";
+  return (char *)err_strerr[-err];
+}
+
+/* Another thread has changed what the loop should be waiting for */
+static void host_wakeup(void)
+{
+  if (!wake_pending) {
+    wake_pending = 1;
+    /* Let the next wakeup try again if this one got lost */
+    if (write(wake_fds[1], "", 1) < 0)
+      wake_pending = 0;
+  }
+}
+
+void host_sockets_init(void)
+{
+  if (pipe(wake_fds) < 0)
+    abort();
+  fcntl(wake_fds[0], F_SETFL, O_NONBLOCK);
+  fcntl(wake_fds[1], F_SETFL, O_NONBLOCK);
+}
+
+/*
+ * pbufs
+ */
+
+static struct pbuf *pbuf_new(u16_t len)
+{
+  struct pbuf *p = malloc(sizeof(struct pbuf) + len);
+  if (p) {
+    p->next = NULL;
+    p->payload = p + 1;
+    p->tot_len = p->len = len;
+    p->ref = 1;
+  }
+  return p;
+}
+
+u8_t pbuf_free(struct pbuf *p)
+{
+  u8_t count = 0;
+  while (p && --p->ref == 0) {
+    struct pbuf *q = p->next;
+    free(p);
+    count++;
+    p = q;
+  }
+  return count;
+}
+
+void pbuf_ref(struct pbuf *p)
+{
+  if (p)
+    p->ref++;
+}
+
+void pbuf_chain(struct pbuf *h, struct pbuf *t)
+{
+  struct pbuf *p;
+  for (p = h; p->next; p = p->next)
+    p->tot_len += t->tot_len;
+  p->tot_len += t->tot_len;
+  p->next = t;
+  pbuf_ref(t);
+}
+
+/*
+ * pcbs
+ */
+
+static void pcb_addrs(struct tcp_pcb *pcb)
+{
+  struct sockaddr_in sin;
+  socklen_t len = sizeof(sin);
+  int mss;
+  if (!getsockname(pcb->fd, (struct sockaddr *)&sin, &len)) {
+    pcb->local_ip.addr = sin.sin_addr.s_addr;
+    pcb->local_port = ntohs(sin.sin_port);
+  }
+  len = sizeof(sin);
+  if (!getpeername(pcb->fd, (struct sockaddr *)&sin, &len)) {
+    pcb->remote_ip.addr = sin.sin_addr.s_addr;
+    pcb->remote_port = ntohs(sin.sin_port);
+  }
+  len = sizeof(mss);
+  if (!getsockopt(pcb->fd, IPPROTO_TCP, TCP_MAXSEG, &mss, &len) &&
+      mss > 0 && mss < TCP_MSS)
+    pcb->mss = mss;
+}
+
+/* Fill in what STAT shows from the kernel's view of the connection */
+static void pcb_info(struct tcp_pcb *pcb)
+{
+  struct tcp_info ti;
+  socklen_t len = sizeof(ti);
+  if (getsockopt(pcb->fd, IPPROTO_TCP, TCP_INFO, &ti, &len))
+    return;
+  pcb->cwnd = ti.tcpi_snd_cwnd * ti.tcpi_snd_mss;
+  pcb->ssthresh = (ti.tcpi_snd_ssthresh < 0xffff?
+		   ti.tcpi_snd_ssthresh * ti.tcpi_snd_mss : 0xffffffff);
+  pcb->nrtx = ti.tcpi_retransmits;
+  pcb->sa = ti.tcpi_rtt / 1000;
+  pcb->sv = ti.tcpi_rttvar / 1000;
+}
+
+static int pcb_socket(struct tcp_pcb *pcb)
+{
+  int one = 1, sndbuf = TCP_SND_BUF;
+  if (pcb->fd >= 0)
+    return 0;
+  if ((pcb->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    return -1;
+  fcntl(pcb->fd, F_SETFL, O_NONBLOCK);
+  setsockopt(pcb->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  setsockopt(pcb->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+  return 0;
+}
+
+static struct tcp_pcb *pcb_new(int fd)
+{
+  struct tcp_pcb *pcb = calloc(1, sizeof(struct tcp_pcb));
+  if (!pcb)
+    return NULL;
+  if (!(pcb->snd_data = malloc(TCP_SND_BUF))) {
+    free(pcb);
+    return NULL;
+  }
+  pcb->fd = fd;
+  pcb->state = CLOSED;
+  pcb->mss = TCP_MSS;
+  pcb->snd_buf = TCP_SND_BUF;
+  pcb->snd_wnd = TCP_SND_BUF;
+  pcb->rcv_wnd = TCP_WND;
+  pcb->next = pcbs;
+  pcbs = pcb;
+  return pcb;
+}
+
+static void pcb_shut(struct tcp_pcb *pcb)
+{
+  if (pcb->fd >= 0)
+    close(pcb->fd);
+  pcb->fd = -1;
+  pcb->dead = 1;
+  pcb->state = CLOSED;
+}
+
+/* The connection is gone; tell the owner like lwIP would */
+static void pcb_fail(struct tcp_pcb *pcb, err_t err)
+{
+  void (*errf)(void *, err_t) = pcb->errf;
+  void *arg = pcb->callback_arg;
+  pcb_shut(pcb);
+  if (errf && !pcb->closed)
+    errf(arg, err);
+  pcb->closed = 1;
+}
+
+static void pcb_flush(struct tcp_pcb *pcb)
+{
+  while (pcb->snd_len > 0 && !pcb->dead) {
+    unsigned int n = TCP_SND_BUF - pcb->snd_head;
+    ssize_t r;
+    if (n > pcb->snd_len)
+      n = pcb->snd_len;
+    r = send(pcb->fd, pcb->snd_data + pcb->snd_head, n,
+	     MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (r < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+	pcb_fail(pcb, ERR_RST);
+      break;
+    }
+    pcb->snd_head = (pcb->snd_head + r) % TCP_SND_BUF;
+    pcb->snd_len -= r;
+    pcb->snd_acked += r;
+  }
+  if (!pcb->snd_len) {
+    pcb->unsent = NULL;
+    pcb->snd_queuelen = 0;
+    if (pcb->state == FIN_WAIT_1)
+      pcb_shut(pcb);
+  }
+  if (pcb->snd_acked)
+    pcb->unacked = &seg_placeholder;
+}
+
+static void pcb_accept(struct tcp_pcb *lpcb)
+{
+  int fd;
+  while (!lpcb->dead && (fd = accept(lpcb->fd, NULL, NULL)) >= 0) {
+    int sndbuf = TCP_SND_BUF;
+    struct tcp_pcb *pcb;
+    err_t err;
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    if (!(pcb = pcb_new(fd))) {
+      close(fd);
+      continue;
+    }
+    pcb->state = ESTABLISHED;
+    pcb->callback_arg = lpcb->callback_arg;
+    pcb_addrs(pcb);
+    err = (lpcb->accept? lpcb->accept(pcb->callback_arg, pcb, ERR_OK) :
+	   ERR_CLSD);
+    if (err != ERR_OK && !pcb->dead)
+      tcp_abort(pcb);
+  }
+}
+
+static void pcb_connected(struct tcp_pcb *pcb)
+{
+  int err = 0;
+  socklen_t len = sizeof(err);
+  pcb->connecting = 0;
+  if (getsockopt(pcb->fd, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+    pcb_fail(pcb, ERR_RST);
+    return;
+  }
+  pcb->state = ESTABLISHED;
+  pcb_addrs(pcb);
+  if (pcb->connected && !pcb->closed)
+    pcb->connected(pcb->callback_arg, pcb, ERR_OK);
+}
+
+static void pcb_receive(struct tcp_pcb *pcb)
+{
+  while (!pcb->dead && !pcb->closed && !pcb->eof && pcb->rcv_wnd > 0) {
+    unsigned int n = (pcb->rcv_wnd < TCP_MSS? pcb->rcv_wnd : TCP_MSS);
+    struct pbuf *p = pbuf_new(n);
+    ssize_t r;
+    if (!p)
+      return;
+    r = recv(pcb->fd, p->payload, n, MSG_DONTWAIT);
+    if (r < 0) {
+      pbuf_free(p);
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+	pcb_fail(pcb, ERR_RST);
+      return;
+    }
+    if (r == 0) {
+      pbuf_free(p);
+      pcb->eof = 1;
+      pcb->state = CLOSE_WAIT;
+      if (pcb->recv)
+	pcb->recv(pcb->callback_arg, pcb, NULL, ERR_OK);
+      else
+	tcp_close(pcb);
+      return;
+    }
+    p->tot_len = p->len = r;
+    pcb->rcv_wnd -= r;
+    if (pcb->recv)
+      pcb->recv(pcb->callback_arg, pcb, p, ERR_OK);
+    else {
+      tcp_recved(pcb, r);
+      pbuf_free(p);
+    }
+  }
+}
+
+/* Hand back the send buffer space the kernel has taken over */
+static void pcb_sent(struct tcp_pcb *pcb)
+{
+  u16_t n = pcb->snd_acked;
+  pcb->snd_acked = 0;
+  pcb->unacked = NULL;
+  pcb->snd_buf += n;
+  pcb_info(pcb);
+  if (pcb->sent && !pcb->closed)
+    pcb->sent(pcb->callback_arg, pcb, n);
+}
+
+/*
+ * Raw API
+ */
+
+struct tcp_pcb *tcp_new(void)
+{
+  return pcb_new(-1);
+}
+
+err_t tcp_bind(struct tcp_pcb *pcb, struct ip_addr *ipaddr, u16_t port)
+{
+  struct sockaddr_in sin;
+  if (pcb_socket(pcb) < 0)
+    return ERR_MEM;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = (ipaddr? ipaddr->addr : INADDR_ANY);
+  sin.sin_port = htons(port);
+  if (bind(pcb->fd, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+    return ERR_USE;
+  pcb->local_ip.addr = sin.sin_addr.s_addr;
+  pcb->local_port = port;
+  return ERR_OK;
+}
+
+struct tcp_pcb *tcp_listen(struct tcp_pcb *pcb)
+{
+  if (pcb_socket(pcb) < 0 || listen(pcb->fd, 8) < 0)
+    return NULL;
+  pcb->state = LISTEN;
+  pcb_addrs(pcb);
+  return pcb;
+}
+
+err_t tcp_connect(struct tcp_pcb *pcb, struct ip_addr *ipaddr, u16_t port,
+		  err_t (*connected)(void *arg, struct tcp_pcb *tpcb,
+				     err_t err))
+{
+  struct sockaddr_in sin;
+  if (pcb_socket(pcb) < 0)
+    return ERR_MEM;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = ipaddr->addr;
+  sin.sin_port = htons(port);
+  if (connect(pcb->fd, (struct sockaddr *)&sin, sizeof(sin)) < 0 &&
+      errno != EINPROGRESS)
+    return ERR_RTE;
+  pcb->remote_ip = *ipaddr;
+  pcb->remote_port = port;
+  pcb->connected = connected;
+  pcb->connecting = 1;
+  pcb->state = SYN_SENT;
+  host_wakeup();
+  return ERR_OK;
+}
+
+err_t tcp_write(struct tcp_pcb *pcb, const void *dataptr, u16_t len,
+		u8_t copy)
+{
+  unsigned int tail, n;
+  if (pcb->closed ||
+      (pcb->state != ESTABLISHED && pcb->state != CLOSE_WAIT))
+    return ERR_CONN;
+  if (len > pcb->snd_buf)
+    return ERR_MEM;
+  /* The data is always copied, so copy == 0 is honoured trivially */
+  tail = (pcb->snd_head + pcb->snd_len) % TCP_SND_BUF;
+  n = TCP_SND_BUF - tail;
+  if (n > len)
+    n = len;
+  memcpy(pcb->snd_data + tail, dataptr, n);
+  memcpy(pcb->snd_data, (const char *)dataptr + n, len - n);
+  pcb->snd_len += len;
+  pcb->snd_buf -= len;
+  pcb->snd_queuelen++;
+  pcb->unsent = &seg_placeholder;
+  host_wakeup();
+  return ERR_OK;
+}
+
+err_t tcp_output(struct tcp_pcb *pcb)
+{
+  if (!pcb->dead && !pcb->connecting)
+    pcb_flush(pcb);
+  return ERR_OK;
+}
+
+void tcp_recved(struct tcp_pcb *pcb, u16_t len)
+{
+  pcb->rcv_wnd += len;
+  if (pcb->rcv_wnd > TCP_WND)
+    pcb->rcv_wnd = TCP_WND;
+  host_wakeup();
+}
+
+err_t tcp_close(struct tcp_pcb *pcb)
+{
+  pcb->closed = 1;
+  if (pcb->state == ESTABLISHED || pcb->state == CLOSE_WAIT) {
+    /* Linger until what has been written is with the kernel */
+    pcb->state = FIN_WAIT_1;
+    pcb_flush(pcb);
+    host_wakeup();
+  } else
+    pcb_shut(pcb);
+  return ERR_OK;
+}
+
+void tcp_abort(struct tcp_pcb *pcb)
+{
+  struct linger lg = { 1, 0 };
+  if (pcb->fd >= 0)
+    setsockopt(pcb->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+  pcb_fail(pcb, ERR_ABRT);
+}
+
+void tcp_arg(struct tcp_pcb *pcb, void *arg)
+{
+  pcb->callback_arg = arg;
+}
+
+void tcp_accept(struct tcp_pcb *pcb,
+		err_t (*accept)(void *arg, struct tcp_pcb *newpcb, err_t err))
+{
+  pcb->accept = accept;
+}
+
+void tcp_recv(struct tcp_pcb *pcb,
+	      err_t (*recv)(void *arg, struct tcp_pcb *tpcb,
+			    struct pbuf *p, err_t err))
+{
+  pcb->recv = recv;
+}
+
+void tcp_sent(struct tcp_pcb *pcb,
+	      err_t (*sent)(void *arg, struct tcp_pcb *tpcb, u16_t len))
+{
+  pcb->sent = sent;
+}
+
+void tcp_err(struct tcp_pcb *pcb, void (*errf)(void *arg, err_t err))
+{
+  pcb->errf = errf;
+}
+
+void tcp_poll(struct tcp_pcb *pcb,
+	      err_t (*poll)(void *arg, struct tcp_pcb *tpcb), u8_t interval)
+{
+  pcb->poll = poll;
+  pcb->pollinterval = interval;
+  pcb->next_poll = host_msec() + interval * TCP_SLOW_INTERVAL;
+}
+
+/*
+ * The loop
+ */
+
+static void reap(void)
+{
+  struct tcp_pcb **pp = &pcbs, *pcb;
+  while ((pcb = *pp))
+    if (pcb->dead) {
+      *pp = pcb->next;
+      free(pcb->snd_data);
+      free(pcb);
+    } else
+      pp = &pcb->next;
+}
+
+void host_loop(void)
+{
+  struct pollfd *fds = NULL;
+  struct tcp_pcb **fdpcbs = NULL;
+  int nalloc = 0;
+
+  for (;;) {
+    struct tcp_pcb *pcb;
+    unsigned long long now;
+    int i, n = 1, ms = host_next_timeout();
+    char buf[64];
+
+    for (pcb = pcbs; pcb; pcb = pcb->next)
+      n++;
+    if (n > nalloc) {
+      nalloc = n * 2;
+      fds = realloc(fds, nalloc * sizeof(struct pollfd));
+      fdpcbs = realloc(fdpcbs, nalloc * sizeof(struct tcp_pcb *));
+      if (!fds || !fdpcbs)
+	abort();
+    }
+    fds[0].fd = wake_fds[0];
+    fds[0].events = POLLIN;
+    now = host_msec();
+    for (n = 1, pcb = pcbs; pcb; pcb = pcb->next) {
+      short events = 0;
+      if (pcb->fd < 0)
+	continue;
+      if (pcb->state == LISTEN)
+	events = POLLIN;
+      else if (pcb->connecting)
+	events = POLLOUT;
+      else {
+	if (!pcb->eof && !pcb->closed && pcb->rcv_wnd > 0)
+	  events |= POLLIN;
+	if (pcb->snd_len > 0)
+	  events |= POLLOUT;
+	if (pcb->snd_acked)
+	  ms = 0;
+      }
+      if (pcb->poll && !pcb->closed) {
+	int left = (pcb->next_poll > now? (int)(pcb->next_poll - now) : 0);
+	if (ms < 0 || left < ms)
+	  ms = left;
+      }
+      /* Nothing to wait for, so do not wake up for hangups either */
+      fds[n].fd = (events? pcb->fd : -1);
+      fds[n].events = events;
+      fds[n].revents = 0;
+      fdpcbs[n++] = pcb;
+    }
+
+    host_unlock();
+    poll(fds, n, ms);
+    host_lock();
+
+    if (fds[0].revents & POLLIN)
+      while (read(wake_fds[0], buf, sizeof(buf)) > 0)
+	;
+    wake_pending = 0;
+
+    for (i = 1; i < n; i++) {
+      short revents = fds[i].revents;
+      pcb = fdpcbs[i];
+      if (pcb->dead || !revents)
+	continue;
+      if (pcb->state == LISTEN)
+	pcb_accept(pcb);
+      else if (pcb->connecting)
+	pcb_connected(pcb);
+      else {
+	if (revents & POLLOUT)
+	  pcb_flush(pcb);
+	if (revents & (POLLIN | POLLHUP | POLLERR))
+	  pcb_receive(pcb);
+      }
+    }
+
+    now = host_msec();
+    for (pcb = pcbs; pcb; pcb = pcb->next) {
+      if (pcb->dead)
+	continue;
+      if (pcb->snd_len > 0 && !pcb->connecting)
+	pcb_flush(pcb);
+      if (pcb->snd_acked && !pcb->dead)
+	pcb_sent(pcb);
+      if (pcb->poll && !pcb->closed && !pcb->dead && pcb->state != LISTEN &&
+	  now >= pcb->next_poll) {
+	pcb->next_poll = now + pcb->pollinterval * TCP_SLOW_INTERVAL;
+	pcb->poll(pcb->callback_arg, pcb);
+      }
+    }
+
+    host_run_timeouts();
+    reap();
+  }
+}
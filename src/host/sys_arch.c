@@ -0,0 +1,277 @@
+/*
+ * Copyright (c) 2012 Marcus Comstedt.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of the contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include <lwip/sys.h>
+#include "host.h"
+
+/*
+ * libronin threads are cooperative, and the rest of the tree relies
+ * on a thread only losing the CPU where it blocks.  The same holds
+ * here by letting a thread run only while it has big_lock, which it
+ * lets go of while waiting for a semaphore, a mailbox or the network.
+ */
+static pthread_mutex_t big_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_condattr_t cond_attr;
+
+#define SYS_MBOX_SIZE 128
+
+struct sys_sem_s {
+  pthread_cond_t cond;
+  int count;
+};
+
+struct sys_mbox_s {
+  pthread_cond_t cond;
+  int first, count;
+  void *msgs[SYS_MBOX_SIZE];
+};
+
+/* Timeouts belong to the thread that set them, as in lwIP */
+typedef struct sys_timeo_s sys_timeo_t;
+
+struct sys_timeo_s {
+  sys_timeo_t *next;
+  unsigned long long when;
+  sys_timeout_handler h;
+  void *arg;
+};
+
+typedef struct host_thread_s {
+  sys_timeo_t *timeouts;
+  void (*fn)(void *);
+  void *arg;
+} host_thread_t;
+
+static host_thread_t main_thread;
+static __thread host_thread_t *current;
+
+unsigned long long host_msec(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void host_lock(void)
+{
+  pthread_mutex_lock(&big_lock);
+}
+
+void host_unlock(void)
+{
+  pthread_mutex_unlock(&big_lock);
+}
+
+/* Milliseconds until the first timeout of this thread, or -1 */
+int host_next_timeout(void)
+{
+  unsigned long long now = host_msec();
+  if (!current->timeouts)
+    return -1;
+  if (current->timeouts->when <= now)
+    return 0;
+  return (int)(current->timeouts->when - now);
+}
+
+void host_run_timeouts(void)
+{
+  unsigned long long now = host_msec();
+  sys_timeo_t *t;
+  while ((t = current->timeouts) && t->when <= now) {
+    sys_timeout_handler h = t->h;
+    void *arg = t->arg;
+    current->timeouts = t->next;
+    free(t);
+    h(arg);
+  }
+}
+
+/* Wait for cond, or until the next timeout is due and has been run */
+static void host_block(pthread_cond_t *cond)
+{
+  int ms = host_next_timeout();
+  if (ms == 0)
+    host_run_timeouts();
+  else if (ms > 0) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(cond, &big_lock, &ts);
+  } else
+    pthread_cond_wait(cond, &big_lock);
+}
+
+sys_sem_t sys_sem_new(u8_t count)
+{
+  sys_sem_t sem = malloc(sizeof(struct sys_sem_s));
+  if (sem) {
+    pthread_cond_init(&sem->cond, &cond_attr);
+    sem->count = count;
+  }
+  return sem;
+}
+
+void sys_sem_signal(sys_sem_t sem)
+{
+  sem->count++;
+  pthread_cond_broadcast(&sem->cond);
+}
+
+void sys_sem_wait(sys_sem_t sem)
+{
+  while (sem->count <= 0)
+    host_block(&sem->cond);
+  --sem->count;
+}
+
+void sys_sem_free(sys_sem_t sem)
+{
+  if (sem) {
+    pthread_cond_destroy(&sem->cond);
+    free(sem);
+  }
+}
+
+sys_mbox_t sys_mbox_new(void)
+{
+  sys_mbox_t mbox = malloc(sizeof(struct sys_mbox_s));
+  if (mbox) {
+    pthread_cond_init(&mbox->cond, &cond_attr);
+    mbox->first = mbox->count = 0;
+  }
+  return mbox;
+}
+
+void sys_mbox_post(sys_mbox_t mbox, void *msg)
+{
+  while (mbox->count == SYS_MBOX_SIZE)
+    host_block(&mbox->cond);
+  mbox->msgs[(mbox->first + mbox->count++) % SYS_MBOX_SIZE] = msg;
+  pthread_cond_broadcast(&mbox->cond);
+}
+
+void sys_mbox_fetch(sys_mbox_t mbox, void **msg)
+{
+  while (mbox->count == 0)
+    host_block(&mbox->cond);
+  *msg = mbox->msgs[mbox->first];
+  mbox->first = (mbox->first + 1) % SYS_MBOX_SIZE;
+  mbox->count--;
+  pthread_cond_broadcast(&mbox->cond);
+}
+
+void sys_mbox_free(sys_mbox_t mbox)
+{
+  if (mbox) {
+    pthread_cond_destroy(&mbox->cond);
+    free(mbox);
+  }
+}
+
+void sys_timeout(u32_t msecs, sys_timeout_handler h, void *arg)
+{
+  sys_timeo_t *t = malloc(sizeof(sys_timeo_t)), **pp;
+  if (!t)
+    abort();
+  t->when = host_msec() + msecs;
+  t->h = h;
+  t->arg = arg;
+  for (pp = &current->timeouts; *pp && (*pp)->when <= t->when;
+       pp = &(*pp)->next)
+    ;
+  t->next = *pp;
+  *pp = t;
+}
+
+void sys_untimeout(sys_timeout_handler h, void *arg)
+{
+  sys_timeo_t **pp, *t;
+  for (pp = &current->timeouts; (t = *pp); pp = &t->next)
+    if (t->h == h && t->arg == arg) {
+      *pp = t->next;
+      free(t);
+      return;
+    }
+}
+
+static void *thread_main(void *arg)
+{
+  host_thread_t *t = arg;
+  host_lock();
+  current = t;
+  t->fn(t->arg);
+  host_unlock();
+  return NULL;
+}
+
+/* The new thread gets to run once the caller blocks */
+void sys_thread_new(void (*thread)(void *arg), void *arg)
+{
+  pthread_t tid;
+  host_thread_t *t = calloc(1, sizeof(host_thread_t));
+  if (!t)
+    abort();
+  t->fn = thread;
+  t->arg = arg;
+  if (pthread_create(&tid, NULL, thread_main, t))
+    abort();
+  pthread_detach(tid);
+}
+
+void sys_thread_yield(int mode)
+{
+  if (mode == YIELD_MODE_STOP)
+    host_loop();
+  host_unlock();
+  sched_yield();
+  host_lock();
+}
+
+void lwip_init(void)
+{
+  signal(SIGPIPE, SIG_IGN);
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  host_lock();
+  current = &main_thread;
+  host_sockets_init();
+}
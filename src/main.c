@@ -33,12 +33,14 @@
 #include "ftpd.h"
 #include "vfs.h"
 #include "backends.h"
+#include "stats.h"
 
 int main()
 {
 #ifdef SERIAL
   serial_init(57600);
 #endif
+  stats_init();
   lwip_init();
   vfs_init();
   flash_be_init();
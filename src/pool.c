@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2012 Marcus Comstedt.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of the contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "pool.h"
+#include "heap.h"
+
+/*
+ * Fixed-size objects that come and go with every connection are kept
+ * in slabs that are allocated once, at init, so that churn never
+ * fragments the heap.  When a pool runs dry the object comes from
+ * the heap instead, and is counted as a miss; pool_free() tells the
+ * two apart by address.  Pools are only ever used from one thread, or
+ * under the lock of the subsystem that owns them.
+ */
+
+static pool_t *pools = NULL;
+
+#define POOL_ALIGN 8
+
+void pool_init(pool_t *pool, int tag, const char *name, size_t size,
+	       int count)
+{
+  int i;
+  pool->name = name;
+  pool->tag = tag;
+  pool->size = (size + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1);
+  pool->used = pool->peak = pool->misses = 0;
+  pool->free = NULL;
+  if ((pool->mem = heap_alloc(tag, pool->size * count)) == NULL)
+    count = 0;
+  pool->count = count;
+  for (i = count; i-- > 0; ) {
+    void **obj = (void **)(pool->mem + i * pool->size);
+    *obj = pool->free;
+    pool->free = obj;
+  }
+  pool->next = pools;
+  pools = pool;
+}
+
+int pool_owns(pool_t *pool, const void *obj)
+{
+  return pool->mem != NULL && (const char *)obj >= pool->mem &&
+    (const char *)obj < pool->mem + pool->size * pool->count;
+}
+
+void *pool_alloc(pool_t *pool)
+{
+  void **obj = pool->free;
+  if (obj) {
+    pool->free = *obj;
+    if (++pool->used > pool->peak)
+      pool->peak = pool->used;
+    return obj;
+  }
+  pool->misses++;
+  return heap_alloc(pool->tag, pool->size);
+}
+
+void pool_free(pool_t *pool, void *obj)
+{
+  if (obj == NULL)
+    return;
+  if (pool_owns(pool, obj)) {
+    *(void **)obj = pool->free;
+    pool->free = obj;
+    --pool->used;
+  } else
+    heap_free(obj);
+}
+
+/* Occupancy of all pools, one line each.  Works like snprintf(). */
+int pool_report(char *buf, size_t size)
+{
+  int len, r;
+  pool_t *pool;
+  len = snprintf(buf, size, "%-16s %6s %5s %5s %5s %6s\n",
+		 "pool", "size", "used", "peak", "count", "misses");
+  for (pool = pools; pool; pool = pool->next) {
+    r = snprintf(buf + (len < size? len : size),
+		 (len < size? size - len : 0),
+		 "%-16s %6u %5d %5d %5d %6d\n", pool->name,
+		 (unsigned)pool->size, pool->used, pool->peak, pool->count,
+		 pool->misses);
+    if (r > 0)
+      len += r;
+  }
+  return len;
+}
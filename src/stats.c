@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2012 Marcus Comstedt.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of the contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#ifdef HOST
+#include <time.h>
+#endif
+
+#include "vfs.h"
+#include "vfsnode.h"
+#include "stats.h"
+
+/*
+ * Each subsystem keeps its own counters and registers a text node
+ * under /stats that renders them, so they can be fetched with RETR.
+ */
+
+#ifndef HOST
+#define TMU_TSTR  (*(volatile unsigned char *)0xffd80004)
+#define TMU_TCOR2 (*(volatile unsigned int *)0xffd80020)
+#define TMU_TCNT2 (*(volatile unsigned int *)0xffd80024)
+#define TMU_TCR2  (*(volatile unsigned short *)0xffd80028)
+#endif
+
+static vfsnode_t *statsdir = NULL;
+
+#ifdef HOST
+
+void stats_init(void)
+{
+}
+
+/* The monotonic clock, scaled to look like TMU2 */
+unsigned long stats_clock(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long)((unsigned long long)ts.tv_sec * STATS_CLOCK_HZ +
+			 (unsigned long long)ts.tv_nsec * STATS_CLOCK_HZ /
+			 1000000000);
+}
+
+#else
+
+void stats_init(void)
+{
+  /* Free running down-counter, wraps after about 343 seconds */
+  TMU_TSTR &= ~4;
+  TMU_TCR2 = 0;
+  TMU_TCOR2 = 0xffffffff;
+  TMU_TCNT2 = 0xffffffff;
+  TMU_TSTR |= 4;
+}
+
+/* Only differences between two readings are meaningful */
+unsigned long stats_clock(void)
+{
+  return ~TMU_TCNT2;
+}
+
+#endif
+
+unsigned long stats_usec(unsigned long ticks)
+{
+  return (unsigned long)(((unsigned long long)ticks * 1000000) /
+			 STATS_CLOCK_HZ);
+}
+
+/*
+ * Append to what has been rendered so far.  Takes and returns the
+ * length as snprintf() does, so that a generator can just carry on
+ * and report how much room it would have needed.
+ */
+int stats_printf(char *buf, size_t size, int len, const char *fmt, ...)
+{
+  int r;
+  va_list va;
+  va_start(va, fmt);
+  r = vsnprintf(buf + (len < size? len : size), (len < size? size - len : 0),
+		fmt, va);
+  va_end(va);
+  return (r > 0? len + r : len);
+}
+
+/* Must be called without the VFS lock */
+void stats_register(const char *name, int (*gen)(char *, size_t))
+{
+  vfs_lock();
+  if (!statsdir)
+    statsdir = vfsnode_mkvirtnode(NULL, "stats");
+  if (statsdir)
+    vfsnode_mktextnode(statsdir, name, gen);
+  vfs_unlock();
+}
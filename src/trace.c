@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2012 Marcus Comstedt.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of the contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <stddef.h>
+
+#include "stats.h"
+#include "trace.h"
+
+/*
+ * The last TRACE_RING spans, kept as complete events.  Names must be
+ * string constants, as only the pointer is stored.  Time is extended
+ * to 64 bits as events are recorded, which works for as long as they
+ * come less than a clock wrap apart.  TRACE_RING must be a power of
+ * two, so that the indices may wrap.
+ */
+#ifndef TRACE_RING
+#define TRACE_RING 2048
+#endif
+
+typedef struct trace_event_s {
+  const char *name;
+  unsigned long long end;
+  unsigned long dur, arg;
+  int lane;
+} trace_event_t;
+
+static trace_event_t trace_ring[TRACE_RING];
+static unsigned int trace_head = 0, trace_used = 0;
+static unsigned long long trace_time = 0;
+static unsigned long trace_last = 0;
+
+int trace_enabled = 0;
+
+static const char *trace_lanes[] = { NULL, "ftpd", "vfs", "gdrom" };
+
+void trace_record(const char *name, int lane, unsigned long start,
+		  unsigned long arg)
+{
+  unsigned long now = stats_clock();
+  trace_event_t *ev;
+  /* Begun before tracing was turned on */
+  if (!start)
+    return;
+  trace_time += now - trace_last;
+  trace_last = now;
+  ev = &trace_ring[trace_head++ % TRACE_RING];
+  ev->name = name;
+  ev->lane = lane;
+  ev->end = trace_time;
+  ev->dur = now - start;
+  if (ev->dur > ev->end)
+    ev->dur = ev->end;
+  ev->arg = arg;
+  if (trace_used < TRACE_RING)
+    trace_used++;
+}
+
+void trace_enable(int on)
+{
+  if (on && !trace_enabled)
+    trace_last = stats_clock();
+  trace_enabled = on;
+}
+
+void trace_clear(void)
+{
+  trace_head = trace_used = 0;
+}
+
+int trace_count(void)
+{
+  return trace_used;
+}
+
+static unsigned long long trace_usec(unsigned long long ticks)
+{
+  return (ticks * 1000000) / STATS_CLOCK_HZ;
+}
+
+/*
+ * The ring as a Chrome trace file, for chrome://tracing or Perfetto.
+ * The range of events is read once, so that the length returned is
+ * that of what was rendered even if events are recorded meanwhile.
+ */
+int trace_json(char *buf, size_t size)
+{
+  int i, len = 0;
+  unsigned int n, head = trace_head, used = trace_used;
+  len = stats_printf(buf, size, len, "{\"traceEvents\":[");
+  for (i = 1; i < sizeof(trace_lanes)/sizeof(trace_lanes[0]); i++)
+    len = stats_printf(buf, size, len,
+		       "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+		       "\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+		       (i > 1? ",\n" : "\n"), i, trace_lanes[i]);
+  for (n = head - used; n != head; n++) {
+    trace_event_t *ev = &trace_ring[n % TRACE_RING];
+    len = stats_printf(buf, size, len,
+		       ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+		       "\"ts\":%llu,\"dur\":%lu,\"args\":{\"n\":%lu}}",
+		       ev->name, ev->lane, trace_usec(ev->end - ev->dur),
+		       stats_usec(ev->dur), ev->arg);
+  }
+  len = stats_printf(buf, size, len, "\n],\"displayTimeUnit\":\"ms\"}\n");
+  return len;
+}
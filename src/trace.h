@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2012 Marcus Comstedt.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of the contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include "stats.h"
+
+/* One row in the trace viewer each */
+#define TRACE_FTPD  1
+#define TRACE_VFS   2
+#define TRACE_GDROM 3
+
+/* Shorter lock waits than this are not worth an event, 10us */
+#define TRACE_MIN_WAIT (STATS_CLOCK_HZ/100000)
+
+extern int trace_enabled;
+
+/*
+ * A span is timed from trace_begin() to trace_end().  With tracing
+ * off, both come down to a test of trace_enabled.
+ */
+#define trace_begin() (trace_enabled? stats_clock() : 0)
+#define trace_end(name, lane, start, arg)				\
+  do { if (trace_enabled) trace_record(name, lane, start, arg); } while (0)
+
+void trace_record(const char *name, int lane, unsigned long start,
+		  unsigned long arg);
+void trace_enable(int on);
+void trace_clear(void);
+int trace_count(void);
+int trace_json(char *buf, size_t size);
+
+#endif				/* __TRACE_H__ */
@@ -37,22 +37,91 @@
 
 #include "vfs.h"
 #include "vfsnode.h"
+#include "pool.h"
+#include "stats.h"
+#include "trace.h"
+#include "heap.h"
 
+/*
+ * The cwd is also kept resolved to its node, which stays valid for as
+ * long as the tree generation is unchanged.  Paths are built in the
+ * per-session scratch buffer, as a session only does one at a time.
+ */
 struct vfs_s {
-  char *cwd;
+  char cwd[VFS_PATH_MAX];
+  vfsnode_t *cwd_node;
+  unsigned long cwd_gen;
+  int cwd_valid;
+  char path[VFS_PATH_MAX];
 };
 
 static sys_sem_t vfs_sema;
 
+/* One per control connection, only opened and closed by ftpd */
+#ifndef VFS_SESSION_POOL
+#define VFS_SESSION_POOL 8
+#endif
+
+static pool_t vfs_pool;
+
+/*
+ * Data read is counted per top level directory, which is where the
+ * backends mount themselves.  The per backend counts are updated with
+ * the lock held.  lookups and cwd_hits are bumped from the lock free
+ * lookup path, which relies on threads being cooperative, as the
+ * epoch counters in vfsnode.c do.
+ */
+#define VFS_STATS_BACKENDS 8
+
+static struct {
+  unsigned long lookups, cwd_hits;
+  struct {
+    char name[16];
+    unsigned long reads;
+    unsigned long long bytes;
+  } backend[VFS_STATS_BACKENDS];
+} vfs_stats;
+
+static void vfs_account(vfsnode_t *node, unsigned long bytes)
+{
+  int i;
+  if (node->dead)
+    return;
+  while (node->parent && node->parent->parent)
+    node = node->parent;
+  for (i = 0; i < VFS_STATS_BACKENDS; i++)
+    if (!vfs_stats.backend[i].name[0] ||
+	!strncmp(vfs_stats.backend[i].name, node->name,
+		 sizeof(vfs_stats.backend[i].name) - 1)) {
+      if (!vfs_stats.backend[i].name[0])
+	strncpy(vfs_stats.backend[i].name, node->name,
+		sizeof(vfs_stats.backend[i].name) - 1);
+      vfs_stats.backend[i].reads++;
+      vfs_stats.backend[i].bytes += bytes;
+      return;
+    }
+}
+
+static int vfs_stats_gen(char *buf, size_t size)
+{
+  int i, len = 0;
+  len = stats_printf(buf, size, len, "lookups %lu\ncwd_hits %lu\n",
+		     vfs_stats.lookups, vfs_stats.cwd_hits);
+  for (i = 0; i < VFS_STATS_BACKENDS && vfs_stats.backend[i].name[0]; i++)
+    len = stats_printf(buf, size, len, "%s.reads %lu\n%s.bytes %llu\n",
+		       vfs_stats.backend[i].name, vfs_stats.backend[i].reads,
+		       vfs_stats.backend[i].name, vfs_stats.backend[i].bytes);
+  return len;
+}
+
 static char *make_absolute_path(vfs_t *vfs, const char *name)
 {
   int l;
-  char *buf;
+  char *buf = vfs->path;
   const char *base = vfs->cwd;
-  if (base == NULL || name[0] == '/')
+  if (!*base || name[0] == '/')
     base = "/";
-  buf = malloc((l = strlen(base))+strlen(name)+2);
-  if (!buf)
+  if ((l = strlen(base)) >= VFS_PATH_MAX)
     return NULL;
   memcpy(buf, base, l);
   for(;;) {
@@ -60,8 +129,11 @@ static char *make_absolute_path(vfs_t *vfs, const char *name)
       name++;
     if (!*name)
       break;
-    if (!l || buf[l-1] != '/')
+    if (!l || buf[l-1] != '/') {
+      if (l >= VFS_PATH_MAX-1)
+	return NULL;
       buf[l++] = '/';
+    }
     if (name[0] == '.' && (name[1] == '/' || name[1] == 0)) {
       name++;
       continue;
@@ -75,26 +147,88 @@ static char *make_absolute_path(vfs_t *vfs, const char *name)
       name+=2;
       continue;
     }
-    while (*name && *name != '/')
+    while (*name && *name != '/') {
+      if (l >= VFS_PATH_MAX-1)
+	return NULL;
       buf[l++] = *name++;
-    if (*name == '/')
+    }
+    if (*name == '/') {
+      if (l >= VFS_PATH_MAX-1)
+	return NULL;
       buf[l++] = '/';
+    }
   }
   buf[l] = 0;
   return buf;
 }
 
-int vfs_stat(vfs_t *vfs, const char *name, vfs_stat_t *st)
+/* True if name can be looked up from the cwd as it is */
+static int is_plain_relative(const char *name)
 {
-  int offs, r = -ENOMEM;
+  if (*name == '/')
+    return 0;
+  while (*name) {
+    if (name[0] == '.' && (name[1] == '/' || name[1] == 0 ||
+			   (name[1] == '.' && (name[2] == '/' || name[2] == 0))))
+      return 0;
+    while (*name && *name != '/')
+      name++;
+    while (*name == '/')
+      name++;
+  }
+  return 1;
+}
+
+/*
+ * Find the node for name, and the part of it that is left for the
+ * node to handle.  Called inside an epoch.  If the path is too long to
+ * be looked up, rest is set to NULL.
+ */
+static vfsnode_t *resolve(vfs_t *vfs, const char *name, const char **rest)
+{
+  int offs;
+  vfsnode_t *node;
   char *path;
-  vfs_lock();
-  if ((path = make_absolute_path(vfs, name))) {
-    vfsnode_t *vfsn = vfsnode_find(path, &offs);
-    r = (vfsn? vfsnode_stat(vfsn, path+offs, st) : -ENOENT);
-    free(path);
+  vfs_stats.lookups++;
+  if (is_plain_relative(name)) {
+    unsigned long gen = vfsnode_generation();
+    if (!vfs->cwd_valid || vfs->cwd_gen != gen) {
+      node = vfsnode_find((*vfs->cwd? vfs->cwd : "/"), &offs);
+      vfs->cwd_node = ((node && !vfs->cwd[offs])? node : NULL);
+      vfs->cwd_gen = gen;
+      vfs->cwd_valid = 1;
+    } else
+      vfs_stats.cwd_hits++;
+    if (vfs->cwd_node) {
+      node = vfsnode_find_from(vfs->cwd_node, name, &offs);
+      *rest = name+offs;
+      return node;
+    }
   }
-  vfs_unlock();
+  if (!(path = make_absolute_path(vfs, name))) {
+    *rest = NULL;
+    return NULL;
+  }
+  node = vfsnode_find(path, &offs);
+  *rest = path+offs;
+  return node;
+}
+
+/*
+ * Lookups don't take the lock, see vfsnode_epoch_enter().  Only
+ * linking a new handle to the node found needs it.
+ */
+int vfs_stat(vfs_t *vfs, const char *name, vfs_stat_t *st)
+{
+  int e, r;
+  const char *rest;
+  vfsnode_t *vfsn;
+  unsigned long t = trace_begin();
+  e = vfsnode_epoch_enter();
+  vfsn = resolve(vfs, name, &rest);
+  r = (vfsn? vfsnode_stat(vfsn, rest, st) : (rest? -ENOENT : -ENAMETOOLONG));
+  vfsnode_epoch_leave(e);
+  trace_end("vfs_stat", TRACE_VFS, t, 0);
   return r;
 }
 
@@ -107,18 +241,33 @@ vfs_dirent_t *vfs_readdir(vfs_dir_t *dir)
   return r;
 }
 
-vfs_dir_t *vfs_opendir(vfs_t *vfs, const char *name)
+int vfs_readdir_r(vfs_dir_t *dir, vfs_dirent_t *de, size_t size)
 {
-  int offs;
-  vfs_dir_t *r = NULL;
-  char *path;
+  int r;
+  unsigned long t = trace_begin();
   vfs_lock();
-  if ((path = make_absolute_path(vfs, name))) {
-    vfsnode_t *vfsn = vfsnode_find(path, &offs);
-    r = (vfsn? vfsnode_opendir(vfsn, path+offs) : NULL);
-    free(path);
-  }
+  r = vfsnode_readdir_r(dir, de, size);
   vfs_unlock();
+  trace_end("vfs_readdir", TRACE_VFS, t, 0);
+  return r;
+}
+
+vfs_dir_t *vfs_opendir(vfs_t *vfs, const char *name)
+{
+  int e;
+  vfs_dir_t *r = NULL;
+  const char *rest;
+  vfsnode_t *vfsn;
+  unsigned long t = trace_begin();
+  e = vfsnode_epoch_enter();
+  if ((vfsn = resolve(vfs, name, &rest))) {
+    vfs_lock();
+    r = vfsnode_opendir(vfsn, rest);
+    vfs_unlock();
+  } else if (!rest)
+    errno = ENAMETOOLONG;
+  vfsnode_epoch_leave(e);
+  trace_end("vfs_opendir", TRACE_VFS, t, 0);
   return r;
 }
 
@@ -133,25 +282,83 @@ int vfs_closedir(vfs_dir_t *dir)
 
 vfs_file_t *vfs_open(vfs_t *vfs, const char *name, const char *mode)
 {
-  int offs, writemode = (strchr(mode, 'w')? 1:0);
+  int e, writemode = (strchr(mode, 'w')? 1:0);
   vfs_file_t *r = NULL;
-  char *path;
+  const char *rest;
+  vfsnode_t *vfsn;
+  unsigned long t = trace_begin();
+  e = vfsnode_epoch_enter();
+  if ((vfsn = resolve(vfs, name, &rest))) {
+    vfs_lock();
+    r = vfsnode_open(vfsn, rest, writemode);
+    vfs_unlock();
+  } else if (!rest)
+    errno = ENAMETOOLONG;
+  vfsnode_epoch_leave(e);
+  trace_end("vfs_open", TRACE_VFS, t, 0);
+  return r;
+}
+
+/*
+ * The lock only protects the tree, so device I/O is done with the
+ * node held instead.  A file is only ever used by one session, so the
+ * backends need not guard its position against concurrent calls.
+ */
+int vfs_read(void *buffer, size_t size, size_t nmemb, vfs_file_t *file)
+{
+  int r;
+  vfsnode_t *node;
+  unsigned long t = trace_begin();
   vfs_lock();
-  if ((path = make_absolute_path(vfs, name))) {
-    vfsnode_t *vfsn = vfsnode_find(path, &offs);
-    r = (vfsn? vfsnode_open(vfsn, path+offs, writemode) : NULL);
-    free(path);
-  }
+  if ((node = vfsnode_hold(file))) {
+    vfs_unlock();
+    r = vfsnode_read(buffer, size, nmemb, file);
+    vfs_lock();
+    if (r > 0)
+      vfs_account(node, r * size);
+    vfsnode_release(node);
+  } else
+    r = vfsnode_read(buffer, size, nmemb, file);
   vfs_unlock();
+  trace_end("vfs_read", TRACE_VFS, t, (r > 0? r * size : 0));
   return r;
 }
 
-int vfs_read(void *buffer, size_t size, size_t nmemb, vfs_file_t *file)
+int vfs_map(const void **ptr, size_t len, vfs_file_t *file)
 {
   int r;
+  vfsnode_t *node;
+  unsigned long t = trace_begin();
   vfs_lock();
-  r = vfsnode_read(buffer, size, nmemb, file);
+  if ((node = vfsnode_hold(file))) {
+    vfs_unlock();
+    r = vfsnode_map(ptr, len, file);
+    vfs_lock();
+    if (r > 0)
+      vfs_account(node, r);
+    vfsnode_release(node);
+  } else
+    r = vfsnode_map(ptr, len, file);
+  vfs_unlock();
+  trace_end("vfs_map", TRACE_VFS, t, (r > 0? r : 0));
+  return r;
+}
+
+int vfs_seek(vfs_file_t *file, unsigned long offset)
+{
+  int r;
+  vfsnode_t *node;
+  unsigned long t = trace_begin();
+  vfs_lock();
+  if ((node = vfsnode_hold(file))) {
+    vfs_unlock();
+    r = vfsnode_seek(file, offset);
+    vfs_lock();
+    vfsnode_release(node);
+  } else
+    r = vfsnode_seek(file, offset);
   vfs_unlock();
+  trace_end("vfs_seek", TRACE_VFS, t, offset);
   return r;
 }
 
@@ -160,6 +367,15 @@ int vfs_write(const void *buffer, size_t size, size_t nmemb, vfs_file_t *file)
   return -ENOSYS;
 }
 
+int vfs_fstat(vfs_file_t *file, vfs_stat_t *st)
+{
+  int r;
+  vfs_lock();
+  r = vfsnode_fstat(file, st);
+  vfs_unlock();
+  return r;
+}
+
 int vfs_eof(vfs_file_t *file)
 {
   int r;
@@ -169,35 +385,38 @@ int vfs_eof(vfs_file_t *file)
   return r;
 }
 
+void vfs_notify(vfs_file_t *file, void (*notify)(void *), void *arg)
+{
+  vfs_lock();
+  vfsnode_notify(file, notify, arg);
+  vfs_unlock();
+}
+
 int vfs_close(vfs_file_t *file)
 {
   int r;
+  unsigned long t = trace_begin();
   vfs_lock();
   r = vfsnode_close(file);
   vfs_unlock();
+  trace_end("vfs_close", TRACE_VFS, t, 0);
   return r;
 }
 
 int vfs_chdir(vfs_t *vfs, const char *path)
 {
   char *apath;
-  vfs_lock();
-  if (!(apath = make_absolute_path(vfs, path))) {
-    vfs_unlock();
-    return -ENOMEM;
-  }
-  if (vfs->cwd)
-    free(vfs->cwd);
-  vfs->cwd = apath;
-  vfs_unlock();
+  if (!(apath = make_absolute_path(vfs, path)))
+    return -ENAMETOOLONG;
+  strcpy(vfs->cwd, apath);
+  vfs->cwd_valid = 0;
   return 0;
 }
 
 char *vfs_getcwd(vfs_t *vfs, char *buf, size_t size)
 {
   const char *cwd;
-  vfs_lock();
-  if(!(cwd = vfs->cwd))
+  if(!*(cwd = vfs->cwd))
     cwd = "/";
   if (buf) {
     if (strlen(cwd) >= size) {
@@ -208,8 +427,7 @@ char *vfs_getcwd(vfs_t *vfs, char *buf, size_t size)
     } else
       strcpy(buf, cwd);
   } else
-    buf = strdup(cwd);
-  vfs_unlock();
+    buf = heap_strdup(HEAP_VFS, cwd);
   return buf;
 }
 
@@ -235,31 +453,40 @@ int vfs_remove(vfs_t *vfs, const char *path)
 
 vfs_t *vfs_openfs(void)
 {
-  vfs_t *vfs = calloc(1, sizeof(vfs_t));
+  vfs_t *vfs = pool_alloc(&vfs_pool);
   if (vfs) {
-    vfs->cwd = NULL;
+    memset(vfs, 0, sizeof(vfs_t));
+    vfs->cwd[0] = 0;
+    vfs->cwd_valid = 0;
   }
   return vfs;
 }
 
 void vfs_closefs(vfs_t *vfs)
 {
-  if (vfs) {
-    vfs_lock();  
-    if (vfs->cwd)
-      free(vfs->cwd);
-    free(vfs);
-    vfs_unlock();  
-  }
+  pool_free(&vfs_pool, vfs);
 }
 
 void vfs_load_plugin(int id)
 {
 }
 
+/*
+ * Changes whenever the tree does, so that callers can tell whether
+ * anything they derived from it is still current.
+ */
+unsigned long vfs_generation(void)
+{
+  return vfsnode_generation();
+}
+
+/* Only waits long enough to matter are traced */
 void vfs_lock(void)
 {
+  unsigned long t = trace_begin();
   sys_sem_wait(vfs_sema);
+  if (trace_enabled && stats_clock() - t >= TRACE_MIN_WAIT)
+    trace_record("vfs_lock", TRACE_VFS, t, 0);
 }
 
 void vfs_unlock(void)
@@ -273,5 +500,11 @@ void vfs_init(void)
   /* create lock... */
   vfs_lock();  
   vfsnode_init();
+  pool_init(&vfs_pool, HEAP_VFS, "vfs_session", sizeof(vfs_t),
+	    VFS_SESSION_POOL);
   vfs_unlock();  
+  stats_register("vfs", vfs_stats_gen);
+  stats_register("pools", pool_report);
+  stats_register("heap", heap_report);
+  stats_register("trace.json", trace_json);
 }
@@ -41,27 +41,58 @@ typedef struct vfs_file_s vfs_file_t;
 typedef struct vfs_stat_s vfs_stat_t;
 typedef struct vfs_s vfs_t;
 
-struct vfs_dirent_s {
-  void *private;
-  char name[];
-};
+#define VFS_PATH_MAX 512
 
 struct vfs_stat_s {
   int st_mode;
   time_t st_mtime;
   size_t st_size;
+  size_t st_blksize;
+  unsigned long st_ino;
 };
 
+/* readdir fills in st, so listings need no stat per entry */
+struct vfs_dirent_s {
+  void *private;
+  vfs_stat_t st;
+  char name[];
+};
+
+#define VFS_NAME_MAX 255
+
+/* Room for any entry, for use with vfs_readdir_r() */
+typedef union vfs_direntbuf_u {
+  vfs_dirent_t de;
+  char space[sizeof(vfs_dirent_t) + VFS_NAME_MAX + 1];
+} vfs_direntbuf_t;
+
+/*
+ * Paths that do not fit in VFS_PATH_MAX once made absolute fail with
+ * -ENAMETOOLONG, or with errno set to ENAMETOOLONG where NULL is
+ * returned.
+ */
 int vfs_stat(vfs_t *vfs, const char *name, vfs_stat_t *st);
 vfs_dirent_t *vfs_readdir(vfs_dir_t *dir);
+int vfs_readdir_r(vfs_dir_t *dir, vfs_dirent_t *de, size_t size);
 vfs_dir_t *vfs_opendir(vfs_t *vfs, const char *path);
 int vfs_closedir(vfs_dir_t *dir);
 vfs_file_t *vfs_open(vfs_t *vfs, const char *path, const char *mode);
+/* Stat what the open file will read, not the node as it is now */
+int vfs_fstat(vfs_file_t *file, vfs_stat_t *st);
 int vfs_read(void *buffer, size_t size, size_t nmemb, vfs_file_t *file);
+int vfs_map(const void **ptr, size_t len, vfs_file_t *file);
+int vfs_seek(vfs_file_t *file, unsigned long offset);
 int vfs_write(const void *buffer, size_t size, size_t nmemb, vfs_file_t *file);
 int vfs_eof(vfs_file_t *file);
+/*
+ * notify is called, from any thread and with the VFS lock held, when a
+ * read that returned -EAGAIN may be retried.  It must not call back
+ * into the VFS or the TCP stack.
+ */
+void vfs_notify(vfs_file_t *file, void (*notify)(void *), void *arg);
 int vfs_close(vfs_file_t *file);
 int vfs_chdir(vfs_t *vfs, const char *path);
+/* With buf NULL, the result is allocated and must go to heap_free() */
 char *vfs_getcwd(vfs_t *vfs, char *buf, size_t size);
 int vfs_rename(vfs_t *vfs, const char *frompath, const char *topath);
 int vfs_mkdir(vfs_t *vfs, const char *path, int mode);
@@ -70,14 +101,19 @@ int vfs_remove(vfs_t *vfs, const char *path);
 vfs_t *vfs_openfs(void);
 void vfs_closefs(vfs_t *vfs);
 void vfs_load_plugin(int id);
+unsigned long vfs_generation(void);
 
 void vfs_init(void);
 
 void vfs_lock(void);
 void vfs_unlock(void);
 
-#define VFS_ISDIR(x) (x)
-#define VFS_ISREG(x) (!(x))
+#define VFS_IFDIR 1
+/* Generated when opened, so the size only holds for one open */
+#define VFS_IFVOLATILE 2
+#define VFS_ISDIR(x) ((x) & VFS_IFDIR)
+#define VFS_ISREG(x) (!VFS_ISDIR(x))
+#define VFS_ISVOLATILE(x) ((x) & VFS_IFVOLATILE)
 
 #define VFS_IRWXU 0
 #define VFS_IRWXG 0
@@ -31,20 +31,150 @@
 
 #include <stdlib.h>
 #include <time.h>
+#include <string.h>
 #include <errno.h>
 
 #include "vfs.h"
 #include "vfsnode.h"
+#include "pool.h"
+#include "heap.h"
 
 static vfsnode_t *rootnode = NULL;
 
+/* Bumped whenever a node is added or removed anywhere in the tree */
+static unsigned long tree_gen = 0;
+
+/* Node ids are never reused, so a new disc gets new ones */
+static unsigned long next_id = 1;
+
+/* Handles are taken from pools, see pool.c.  All use is under the lock. */
+#ifndef VFS_FILE_POOL
+#define VFS_FILE_POOL 16
+#endif
+#ifndef VFS_DIR_POOL
+#define VFS_DIR_POOL 8
+#endif
+
+static pool_t file_pool, dir_pool, dirent_pool;
+
+/*
+ * A subtree made with vfsnode_mksubtree() has its nodes and their
+ * private data bump-allocated from chunks owned by an arena, so they
+ * lie together in the order they were made.  Nothing is freed on its
+ * own; the chunks all go at once when the last node is reclaimed.
+ */
+#define ARENA_CHUNK 4096
+#define ARENA_ALIGN 8
+
+typedef struct arena_chunk_s {
+  struct arena_chunk_s *next;
+  size_t used, size;
+  char mem[] __attribute__((aligned(ARENA_ALIGN)));
+} arena_chunk_t;
+
+struct vfsnode_arena_s {
+  arena_chunk_t *chunks;
+  int nodes;
+};
+
+static void *arena_alloc(vfsnode_arena_t *arena, size_t size)
+{
+  arena_chunk_t *chunk = arena->chunks;
+  size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+  if (!chunk || chunk->size - chunk->used < size) {
+    size_t csize = (size > ARENA_CHUNK? size : ARENA_CHUNK);
+    if (!(chunk = heap_calloc(HEAP_ARENA, 1, sizeof(arena_chunk_t) + csize)))
+      return NULL;
+    chunk->size = csize;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+  }
+  chunk->used += size;
+  return chunk->mem + chunk->used - size;
+}
+
+static void arena_release(vfsnode_arena_t *arena)
+{
+  arena_chunk_t *chunk;
+  while ((chunk = arena->chunks)) {
+    arena->chunks = chunk->next;
+    heap_free(chunk);
+  }
+  heap_free(arena);
+}
+
+/*
+ * Zeroed memory that lives as long as the node.  Backends must use
+ * this for node->private, as it is not freed separately for nodes
+ * in an arena.
+ */
+void *vfsnode_alloc(vfsnode_t *node, size_t size)
+{
+  if (node->arena)
+    return arena_alloc(node->arena, size);
+  else
+    return heap_calloc(HEAP_VFSNODE, 1, size);
+}
+
+/*
+ * Lookups walk the tree without the VFS lock, inside an epoch.  Nodes
+ * that are unlinked go to the limbo list of the current epoch, and are
+ * only freed once every reader that could have seen them has left.
+ * This relies on threads being cooperative, so the counters need no
+ * atomic updates and a reader is never preempted halfway through.
+ */
+static unsigned int epoch = 0;
+static int epoch_readers[2] = { 0, 0 };
+static vfsnode_t *limbo[2] = { NULL, NULL };
+
+/* Keep the compiler from moving stores across a publication */
+#define vfsnode_barrier() __asm__ __volatile__("" ::: "memory")
+
+/*
+ * Directories with more than a few children also index them in a hash
+ * table, chained through hash_link, which grows with the directory.
+ * Lookups never yield, so the table can be rebuilt in place.
+ */
+#define VIRTNODE_HASH_MIN 8
+
 typedef struct virtnode_private_s {
   vfsnode_t *first_child, *last_child;
+  int nchildren;
+  unsigned int hashsize;
+  vfsnode_t **hash;
 } virtnode_private_t;
 
+/* FNV-1a over one path component */
+static unsigned int name_hash(const char *name)
+{
+  unsigned int h = 2166136261u;
+  while (*name && *name != '/')
+    h = (h ^ (unsigned char)*name++) * 16777619u;
+  return h;
+}
+
+static int virtnode_rehash(virtnode_private_t *private, unsigned int size)
+{
+  vfsnode_t **hash = heap_calloc(HEAP_VFSNODE, size, sizeof(vfsnode_t *));
+  vfsnode_t **old, *child;
+  if (!hash)
+    return -ENOMEM;
+  for (child = private->first_child; child; child = child->sibling) {
+    unsigned int h = name_hash(child->name) & (size-1);
+    child->hash_link = hash[h];
+    hash[h] = child;
+  }
+  old = private->hash;
+  vfsnode_barrier();
+  private->hashsize = size;
+  private->hash = hash;
+  heap_free(old);
+  return 0;
+}
+
 static void virtnode_init(vfsnode_t *node, void *context)
 {
-  virtnode_private_t *private = calloc(1, sizeof(virtnode_private_t));
+  virtnode_private_t *private = vfsnode_alloc(node, sizeof(virtnode_private_t));
   if (private) {
     private->first_child = NULL;
     private->last_child = NULL;
@@ -59,6 +189,10 @@ static void virtnode_destroy(vfsnode_t *node)
     vfsnode_t *child;
     while ((child = private->first_child))
       vfsnode_destroy(child);
+    if (private->hash) {
+      heap_free(private->hash);
+      private->hash = NULL;
+    }
   }
 }
 
@@ -66,20 +200,48 @@ static void virtnode_add_child(vfsnode_t *node, vfsnode_t *childnode)
 {
   virtnode_private_t *private = (virtnode_private_t *)node->private;
   if (private) {
+    int grow;
     childnode->sibling = NULL;
+    /* Lookups may see the child as soon as it is linked in */
+    vfsnode_barrier();
     if (private->last_child != NULL) {
       private->last_child->sibling = childnode;
     } else {
       private->first_child = childnode;
     }
     private->last_child = childnode;
+    grow = (++private->nchildren > 2 * private->hashsize &&
+	    private->nchildren >= VIRTNODE_HASH_MIN);
+    /* A table that could not grow still has to index the child */
+    if ((!grow || virtnode_rehash(private, (private->hashsize?
+					    2 * private->hashsize : 16)) < 0) &&
+	private->hash) {
+      unsigned int h = name_hash(childnode->name) & (private->hashsize-1);
+      childnode->hash_link = private->hash[h];
+      vfsnode_barrier();
+      private->hash[h] = childnode;
+    }
   }
 }
 
+/*
+ * The removed node's sibling link is left alone, so a lookup standing
+ * on it can still walk on to the rest of the list.
+ */
 static void virtnode_remove_child(vfsnode_t *node, vfsnode_t *childnode)
 {
   virtnode_private_t *private = (virtnode_private_t *)node->private;
-  if (private)
+  if (private) {
+    if (private->hash) {
+      vfsnode_t **pp = &private->hash[name_hash(childnode->name) &
+				      (private->hashsize-1)];
+      for (; *pp; pp = &(*pp)->hash_link)
+	if (*pp == childnode) {
+	  *pp = childnode->hash_link;
+	  break;
+	}
+    }
+    private->nchildren--;
     if (childnode == private->first_child) {
       if ((private->first_child = childnode->sibling) == NULL)
 	private->last_child = NULL;
@@ -92,6 +254,7 @@ static void virtnode_remove_child(vfsnode_t *node, vfsnode_t *childnode)
 	  break;
 	}
     }
+  }
 }
 
 static int compare_name(const char *a, const char *b)
@@ -116,9 +279,15 @@ static vfsnode_t *virtnode_find(vfsnode_t *node, const char *path, int *offs)
       o++;
     if (path[o]) {
       int z;
-      for(node = private->first_child; node != NULL; node = node->sibling)
-	if ((z = compare_name(path+o, node->name)))
-	  break;
+      if (private->hash) {
+	for(node = private->hash[name_hash(path+o) & (private->hashsize-1)];
+	    node != NULL; node = node->hash_link)
+	  if ((z = compare_name(path+o, node->name)))
+	    break;
+      } else
+	for(node = private->first_child; node != NULL; node = node->sibling)
+	  if ((z = compare_name(path+o, node->name)))
+	    break;
       if (node) {
 	o += z;
 	while(path[o] == '/' && path[o+1] == '/')
@@ -139,24 +308,25 @@ static int virtnode_opendir(vfsnode_t *node, vfs_dir_t *dir, const char *path)
   return 0;
 }
 
-static vfs_dirent_t *virtnode_readdir(vfsnode_t *node_, vfs_dir_t *dir)
+static int virtnode_readdir(vfsnode_t *node_, vfs_dir_t *dir,
+			    vfs_dirent_t *de, size_t size)
 {
   vfsnode_t *node = dir->posp;
   if (node) {
-    vfs_dirent_t *de = calloc(1, sizeof(vfs_dirent_t)+1+strlen(node->name));
-    if (de) {
-      dir->posp = node->sibling;
-      strcpy(de->name, node->name);
-    } else
-      dir->posp = NULL;
-    return de;
+    dir->posp = node->sibling;
+    if (sizeof(vfs_dirent_t)+strlen(node->name) >= size)
+      return -ENAMETOOLONG;
+    de->private = NULL;
+    strcpy(de->name, node->name);
+    vfsnode_stat(node, "", &de->st);
+    return 1;
   } else
-    return NULL;
+    return 0;
 }
 
 static int virtnode_stat(vfsnode_t *node, const char *path, vfs_stat_t *st)
 {
-  st->st_mode = 1;
+  st->st_mode = VFS_IFDIR;
   return 0;
 }
 
@@ -173,13 +343,15 @@ static vfsnode_vtable_t virtnode_vtable = {
 
 typedef struct rom_s { const void *data; size_t len; } rom_t;
 
+#define ROM_BLKSIZE 4096
+
 typedef struct romnode_private_s {
   rom_t rom;
 } romnode_private_t;
 
 static void romnode_init(vfsnode_t *node, void *context)
 {
-  romnode_private_t *private = calloc(1, sizeof(romnode_private_t));
+  romnode_private_t *private = vfsnode_alloc(node, sizeof(romnode_private_t));
   if (private) {
     private->rom = *(const rom_t *)context;
     node->private = private;
@@ -191,6 +363,8 @@ static int romnode_stat(vfsnode_t *node, const char *path, vfs_stat_t *st)
   romnode_private_t *private = (romnode_private_t *)node->private;
   if (private) {
     st->st_size = private->rom.len;
+    st->st_blksize = ROM_BLKSIZE;
+    return 0;
   } else
     return -ENOENT;
 }
@@ -224,19 +398,199 @@ static int romnode_read(vfsnode_t *node, vfs_file_t *file, void *buffer,
     return 0;
 }
 
+static int romnode_map(vfsnode_t *node, vfs_file_t *file, const void **ptr,
+		       size_t len)
+{
+  romnode_private_t *private = (romnode_private_t *)node->private;
+  if (private) {
+    size_t bytes = private->rom.len - file->posn;
+    if (bytes > len)
+      bytes = len;
+    *ptr = ((const char *)private->rom.data) + file->posn;
+    file->posn += bytes;
+    return bytes;
+  } else
+    return 0;
+}
+
+static int romnode_seek(vfsnode_t *node, vfs_file_t *file,
+			unsigned long offset)
+{
+  romnode_private_t *private = (romnode_private_t *)node->private;
+  if (!private || offset > private->rom.len)
+    return -EINVAL;
+  file->posn = offset;
+  return 0;
+}
+
 static vfsnode_vtable_t romnode_vtable = {
   .init = romnode_init,
   .stat = romnode_stat,
   .open = romnode_open,
   .read = romnode_read,
+  .map = romnode_map,
+  .seek = romnode_seek,
 };
 
+/*
+ * Text nodes have their content generated by a callback.  It is
+ * rendered once per open, so that a reader sees one consistent
+ * snapshot however slowly it reads.  Rendering can be costly, so stat
+ * reports the size of the last snapshot instead; vfs_fstat() gives the
+ * size of the one a file reads.
+ */
+#define TEXTNODE_BUFSIZE 1024
+#define TEXT_BLKSIZE 4096
+
+typedef struct textnode_private_s {
+  vfsnode_textgen_t gen;
+  size_t last_len;
+} textnode_private_t;
 
-vfsnode_t *vfsnode_mknode(vfsnode_t *parent, const char *name, vfsnode_vtable_t *vtable, void *context)
+typedef struct textsnap_s {
+  size_t len;
+  char data[];
+} textsnap_t;
+
+static void textnode_init(vfsnode_t *node, void *context)
 {
-  vfsnode_t *node = calloc(1, sizeof(vfsnode_t)+1+strlen(name));
+  textnode_private_t *private = vfsnode_alloc(node, sizeof(textnode_private_t));
+  if (private) {
+    private->gen = *(vfsnode_textgen_t *)context;
+    private->last_len = 0;
+    node->private = private;
+  }
+}
+
+static textsnap_t *textnode_render(vfsnode_t *node)
+{
+  textnode_private_t *private = (textnode_private_t *)node->private;
+  size_t size = TEXTNODE_BUFSIZE;
+  textsnap_t *snap;
+  int len;
+  if (!private)
+    return NULL;
+  for (;;) {
+    if (!(snap = heap_alloc(HEAP_VFSNODE, sizeof(textsnap_t) + size)))
+      return NULL;
+    if ((len = private->gen(snap->data, size)) < 0) {
+      heap_free(snap);
+      return NULL;
+    }
+    if (len < size) {
+      snap->len = private->last_len = len;
+      return snap;
+    }
+    /* Didn't fit, try again with what the generator asked for */
+    heap_free(snap);
+    size = len + 1;
+  }
+}
+
+static int textnode_stat(vfsnode_t *node, const char *path, vfs_stat_t *st)
+{
+  textnode_private_t *private = (textnode_private_t *)node->private;
+  if (*path || !private)
+    return -ENOENT;
+  st->st_mode = VFS_IFVOLATILE;
+  st->st_size = private->last_len;
+  st->st_blksize = TEXT_BLKSIZE;
+  st->st_mtime = time(NULL);
+  return 0;
+}
+
+/* The size of the snapshot this file reads, not of a fresh rendering */
+static int textnode_fstat(vfsnode_t *node, vfs_file_t *file, vfs_stat_t *st)
+{
+  textsnap_t *snap = (textsnap_t *)file->posp;
+  st->st_mode = VFS_IFVOLATILE;
+  st->st_size = snap->len;
+  st->st_blksize = TEXT_BLKSIZE;
+  st->st_mtime = time(NULL);
+  return 0;
+}
+
+static int textnode_open(vfsnode_t *node, vfs_file_t *file, const char *path,
+			 int write_mode)
+{
+  if (*path)
+    return -ENOENT;
+  if (write_mode)
+    return -EROFS;
+  if (!(file->posp = textnode_render(node)))
+    return -ENOMEM;
+  file->posn = 0;
+  return 0;
+}
+
+static int textnode_read(vfsnode_t *node, vfs_file_t *file, void *buffer,
+			 size_t size, size_t nmemb)
+{
+  textsnap_t *snap = (textsnap_t *)file->posp;
+  size_t bytes, cnt = (snap->len - file->posn)/size;
+  if (cnt > nmemb)
+    cnt = nmemb;
+  bytes = cnt * size;
+  if (bytes) {
+    memcpy(buffer, snap->data + file->posn, bytes);
+    file->posn += bytes;
+  }
+  return cnt;
+}
+
+static int textnode_map(vfsnode_t *node, vfs_file_t *file, const void **ptr,
+			size_t len)
+{
+  textsnap_t *snap = (textsnap_t *)file->posp;
+  size_t bytes = snap->len - file->posn;
+  if (bytes > len)
+    bytes = len;
+  *ptr = snap->data + file->posn;
+  file->posn += bytes;
+  return bytes;
+}
+
+static int textnode_seek(vfsnode_t *node, vfs_file_t *file,
+			 unsigned long offset)
+{
+  textsnap_t *snap = (textsnap_t *)file->posp;
+  if (offset > snap->len)
+    return -EINVAL;
+  file->posn = offset;
+  return 0;
+}
+
+static int textnode_close(vfsnode_t *node, vfs_file_t *file)
+{
+  heap_free(file->posp);
+  file->posp = NULL;
+  return 0;
+}
+
+static vfsnode_vtable_t textnode_vtable = {
+  .init = textnode_init,
+  .stat = textnode_stat,
+  .fstat = textnode_fstat,
+  .open = textnode_open,
+  .read = textnode_read,
+  .map = textnode_map,
+  .seek = textnode_seek,
+  .close = textnode_close,
+};
+
+
+static vfsnode_t *vfsnode_mknode_in(vfsnode_arena_t *arena, vfsnode_t *parent,
+				    const char *name, vfsnode_vtable_t *vtable,
+				    void *context)
+{
+  size_t size = sizeof(vfsnode_t)+1+strlen(name);
+  vfsnode_t *node = (arena? arena_alloc(arena, size) :
+		     heap_calloc(HEAP_VFSNODE, 1, size));
   if (node) {
+    if ((node->arena = arena))
+      arena->nodes++;
     node->vtable = vtable;
+    node->id = next_id++;
     if (parent == NULL)
       parent = rootnode;
     node->parent = parent;
@@ -250,10 +604,33 @@ vfsnode_t *vfsnode_mknode(vfsnode_t *parent, const char *name, vfsnode_vtable_t
       vtable->init(node, context);
     if (parent != NULL && parent->vtable->add_child)
       parent->vtable->add_child(parent, node);
+    tree_gen++;
   }
   return node;
 }
 
+vfsnode_t *vfsnode_mknode(vfsnode_t *parent, const char *name, vfsnode_vtable_t *vtable, void *context)
+{
+  return vfsnode_mknode_in((parent? parent->arena : NULL), parent, name,
+			   vtable, context);
+}
+
+/*
+ * A directory whose descendants are all allocated from an arena of
+ * their own, for backends that build and tear down whole subtrees.
+ */
+vfsnode_t *vfsnode_mksubtree(vfsnode_t *parent, const char *name)
+{
+  vfsnode_t *node;
+  vfsnode_arena_t *arena = heap_calloc(HEAP_ARENA, 1, sizeof(vfsnode_arena_t));
+  if (!arena)
+    return NULL;
+  if (!(node = vfsnode_mknode_in(arena, parent, name, &virtnode_vtable,
+				 NULL)))
+    arena_release(arena);
+  return node;
+}
+
 vfsnode_t *vfsnode_mkvirtnode(vfsnode_t *parent, const char *name)
 {
   return vfsnode_mknode(parent, name, &virtnode_vtable, NULL);
@@ -266,15 +643,14 @@ vfsnode_t *vfsnode_mkromnode(vfsnode_t *parent, const char *name,
   return vfsnode_mknode(parent, name, &romnode_vtable, &rom);
 }
 
-void vfsnode_destroy(vfsnode_t *node)
+vfsnode_t *vfsnode_mktextnode(vfsnode_t *parent, const char *name,
+			      vfsnode_textgen_t gen)
+{
+  return vfsnode_mknode(parent, name, &textnode_vtable, &gen);
+}
+
+static void vfsnode_free(vfsnode_t *node)
 {
-  if (node == rootnode)
-    rootnode = NULL;
-  if (node->parent) {
-    if (node->parent->vtable->remove_child)
-      node->parent->vtable->remove_child(node->parent, node);
-    node->parent = NULL;
-  }
   while (node->dirs) {
     vfs_dir_t *dd = node->dirs;
     node->dirs = dd->link;
@@ -293,19 +669,115 @@ void vfsnode_destroy(vfsnode_t *node)
       node->vtable->close(node, ff);
     ff->node = NULL;
   }
+  if (node->arena) {
+    if (!--node->arena->nodes)
+      arena_release(node->arena);
+  } else {
+    heap_free(node->private);
+    heap_free(node);
+  }
+}
+
+/*
+ * Free what has been retired two epochs ago, advancing the epoch for
+ * as long as no reader is left in the previous one.  Called with the
+ * VFS lock held.
+ */
+static void vfsnode_reclaim(void)
+{
+  while (!epoch_readers[(epoch+1)&1] && (limbo[0] || limbo[1])) {
+    vfsnode_t *node;
+    epoch++;
+    while ((node = limbo[epoch&1])) {
+      limbo[epoch&1] = node->limbo;
+      vfsnode_free(node);
+    }
+  }
+}
+
+static void vfsnode_retire(vfsnode_t *node)
+{
+  node->limbo = limbo[epoch&1];
+  limbo[epoch&1] = node;
+  vfsnode_reclaim();
+}
+
+unsigned long vfsnode_generation(void)
+{
+  return tree_gen;
+}
+
+int vfsnode_epoch_enter(void)
+{
+  int e = epoch&1;
+  epoch_readers[e]++;
+  return e;
+}
+
+/*
+ * Must be called without the VFS lock, as the last reader to leave
+ * takes it to free the nodes it was holding back.
+ */
+void vfsnode_epoch_leave(int e)
+{
+  if (!--epoch_readers[e] && (limbo[0] || limbo[1])) {
+    vfs_lock();
+    vfsnode_reclaim();
+    vfs_unlock();
+  }
+}
+
+/*
+ * The node is unlinked from the tree at once, and its children are
+ * destroyed with it.  The memory lives on until no lookup can still
+ * see the node and no file I/O is running on it outside the VFS lock.
+ */
+void vfsnode_destroy(vfsnode_t *node)
+{
+  if (node == rootnode)
+    rootnode = NULL;
+  if (node->parent) {
+    if (node->parent->vtable->remove_child)
+      node->parent->vtable->remove_child(node->parent, node);
+    node->parent = NULL;
+  }
+  tree_gen++;
+  node->dead = 1;
   if (node->vtable->destroy)
     node->vtable->destroy(node);
-  if (node->private)
-    free(node->private);
-  free(node);
+  if (!node->refs)
+    vfsnode_retire(node);
+}
+
+/*
+ * Pin the node of an open file, so that it can be used after the VFS
+ * lock has been dropped.  Both calls must be made with the lock held.
+ */
+vfsnode_t *vfsnode_hold(vfs_file_t *file)
+{
+  vfsnode_t *node;
+  if (!file || !(node = file->node) || node->dead)
+    return NULL;
+  node->refs++;
+  return node;
+}
+
+void vfsnode_release(vfsnode_t *node)
+{
+  if (node && !--node->refs && node->dead)
+    vfsnode_retire(node);
 }
 
 vfsnode_t *vfsnode_find(const char *path, int *offs)
 {
-  vfsnode_t *node = rootnode;
+  return vfsnode_find_from(rootnode, path, offs);
+}
+
+vfsnode_t *vfsnode_find_from(vfsnode_t *node, const char *path, int *offs)
+{
   int loffs, toffs = 0;
   while (node && node->vtable->find) {
-    node = rootnode->vtable->find(node, path, &loffs);
+    node = node->vtable->find(node, path, &loffs);
     if (!node || !loffs)
       break;
     toffs += loffs;
@@ -316,25 +788,50 @@ vfsnode_t *vfsnode_find(const char *path, int *offs)
   return node;
 }
 
+/*
+ * Fill in the caller's de, which is size bytes, with the next entry.
+ * Returns 1 for an entry, 0 at the end, or a negative error; an entry
+ * that does not fit is skipped with -ENAMETOOLONG.
+ */
+int vfsnode_readdir_r(vfs_dir_t *dir, vfs_dirent_t *de, size_t size)
+{
+  if (!dir)
+    return -EBADF;
+  if (dir->node && !dir->node->dead && dir->node->vtable->readdir)
+    return dir->node->vtable->readdir(dir->node, dir, de, size);
+  else
+    return 0;
+}
+
+/*
+ * The returned entry is only valid until the next call on dir.
+ */
 vfs_dirent_t *vfsnode_readdir(vfs_dir_t *dir)
 {
-  if (dir && dir->node && dir->node->vtable->readdir) {
-    if (dir->dirent)
-      free(dir->dirent);
-    return (dir->dirent = dir->node->vtable->readdir(dir->node, dir));
-  } else
+  int r;
+  if (!dir)
+    return NULL;
+  if (!dir->dirent &&
+      !(dir->dirent = pool_alloc(&dirent_pool)))
     return NULL;
+  while ((r = vfsnode_readdir_r(dir, dir->dirent,
+				sizeof(vfs_direntbuf_t))) == -ENAMETOOLONG)
+    ;
+  return (r > 0? dir->dirent : NULL);
 }
 
 vfs_dir_t *vfsnode_opendir(vfsnode_t *node, const char *path)
 {
-  if (node->vtable->opendir) {
-    vfs_dir_t *dir = calloc(1, sizeof(vfs_dir_t));
+  if (!node->dead && node->vtable->opendir) {
+    vfs_dir_t *dir = pool_alloc(&dir_pool);
+    if (!dir)
+      return NULL;
+    memset(dir, 0, sizeof(vfs_dir_t));
     dir->link = NULL;
     dir->node = node;
     dir->dirent = NULL;
     if (node->vtable->opendir(node, dir, path)) {
-      free(dir);
+      pool_free(&dir_pool, dir);
       dir = NULL;
     } else {
       dir->link = node->dirs;
@@ -365,9 +862,8 @@ int vfsnode_closedir(vfs_dir_t *dir)
 	}
     }
   }
-  if (dir->dirent)
-    free(dir->dirent);
-  free(dir);
+  pool_free(&dirent_pool, dir->dirent);
+  pool_free(&dir_pool, dir);
   return 0;
 }
 
@@ -375,6 +871,7 @@ int vfsnode_stat(vfsnode_t *node, const char *path, vfs_stat_t *st)
 {
   if (node->vtable->stat) {
     memset(st, 0, sizeof(vfs_stat_t));
+    st->st_ino = node->id;
     return node->vtable->stat(node, path, st);
   } else
     return -ENOSYS;
@@ -382,13 +879,16 @@ int vfsnode_stat(vfsnode_t *node, const char *path, vfs_stat_t *st)
 
 vfs_file_t *vfsnode_open(vfsnode_t *node, const char *path, int write_mode)
 {
-  if (node->vtable->open) {
-    vfs_file_t *file = calloc(1, sizeof(vfs_file_t));
+  if (!node->dead && node->vtable->open) {
+    vfs_file_t *file = pool_alloc(&file_pool);
+    if (!file)
+      return NULL;
+    memset(file, 0, sizeof(vfs_file_t));
     file->link = NULL;
     file->node = node;
     file->eof = 0;
     if (node->vtable->open(node, file, path, write_mode)) {
-      free(file);
+      pool_free(&file_pool, file);
       file = NULL;
     } else {
       file->link = node->files;
@@ -399,13 +899,17 @@ vfs_file_t *vfsnode_open(vfsnode_t *node, const char *path, int write_mode)
     return NULL;
 }
 
+/*
+ * Reads from a file whose node has gone, such as a track of an ejected
+ * disc, fail rather than end the file early.
+ */
 int vfsnode_read(void *buffer, size_t size, size_t nmemb, vfs_file_t *file)
 {
   vfsnode_t *node;
   if(!file)
     return -EBADF;
   node = file->node;
-  if (node) {
+  if (node && !node->dead) {
     int r = 0;
     if (node->vtable->read)
       r = node->vtable->read(node, file, buffer, size, nmemb);
@@ -413,7 +917,63 @@ int vfsnode_read(void *buffer, size_t size, size_t nmemb, vfs_file_t *file)
       file->eof = 1;
     return r;
   } else
-    return 0;
+    return -ENXIO;
+}
+
+/*
+ * Map up to len bytes at the current position and advance past them.
+ * The returned memory stays valid for as long as the file is open.
+ */
+int vfsnode_map(const void **ptr, size_t len, vfs_file_t *file)
+{
+  vfsnode_t *node;
+  if(!file)
+    return -EBADF;
+  node = file->node;
+  if (node && !node->dead) {
+    int r;
+    if (!node->vtable->map)
+      return -ENOSYS;
+    r = node->vtable->map(node, file, ptr, len);
+    if (r == 0 && len > 0)
+      file->eof = 1;
+    return r;
+  } else
+    return -ENXIO;
+}
+
+int vfsnode_seek(vfs_file_t *file, unsigned long offset)
+{
+  vfsnode_t *node;
+  if(!file)
+    return -EBADF;
+  node = file->node;
+  if (node && !node->dead) {
+    int r;
+    if (!node->vtable->seek)
+      return -ESPIPE;
+    if (!(r = node->vtable->seek(node, file, offset)))
+      file->eof = 0;
+    return r;
+  } else
+    return -EBADF;
+}
+
+/* Nodes without an fstat have the same size for every open */
+int vfsnode_fstat(vfs_file_t *file, vfs_stat_t *st)
+{
+  vfsnode_t *node;
+  if(!file)
+    return -EBADF;
+  node = file->node;
+  if (node && !node->dead) {
+    if (!node->vtable->fstat)
+      return vfsnode_stat(node, "", st);
+    memset(st, 0, sizeof(vfs_stat_t));
+    st->st_ino = node->id;
+    return node->vtable->fstat(node, file, st);
+  } else
+    return -EBADF;
 }
 
 int vfsnode_eof(vfs_file_t *file)
@@ -422,7 +982,7 @@ int vfsnode_eof(vfs_file_t *file)
   if(!file)
     return -EBADF;
   node = file->node;
-  if (node) {
+  if (node && !node->dead) {
     if (node->vtable->eof)
       return node->vtable->eof(node, file);
     else
@@ -431,6 +991,20 @@ int vfsnode_eof(vfs_file_t *file)
     return 1;
 }
 
+/*
+ * A backend whose read returned -EAGAIN calls the notify handler once
+ * more data can be read.  The handler is called with the VFS lock
+ * held, from whatever thread completed the I/O, and must not call back
+ * into the VFS.
+ */
+void vfsnode_notify(vfs_file_t *file, void (*notify)(void *), void *arg)
+{
+  if (file) {
+    file->notify = notify;
+    file->notify_arg = arg;
+  }
+}
+
 int vfsnode_close(vfs_file_t *file)
 {
   vfsnode_t *node;
@@ -451,11 +1025,16 @@ int vfsnode_close(vfs_file_t *file)
 	}
     }
   }
-  free(file);
+  pool_free(&file_pool, file);
   return 0;
 }
 
 void vfsnode_init(void)
 {
+  pool_init(&file_pool, HEAP_VFS, "vfs_file", sizeof(vfs_file_t),
+	    VFS_FILE_POOL);
+  pool_init(&dir_pool, HEAP_VFS, "vfs_dir", sizeof(vfs_dir_t), VFS_DIR_POOL);
+  pool_init(&dirent_pool, HEAP_VFS, "vfs_dirent", sizeof(vfs_direntbuf_t),
+	    VFS_DIR_POOL);
   rootnode = vfsnode_mkvirtnode(NULL, "");
 }
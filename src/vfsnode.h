@@ -34,13 +34,19 @@
 
 typedef struct vfsnode_s vfsnode_t;
 typedef struct vfsnode_vtable_s vfsnode_vtable_t;
+typedef struct vfsnode_arena_s vfsnode_arena_t;
+typedef int (*vfsnode_textgen_t)(char *, size_t);
 
 struct vfsnode_s {
   vfsnode_vtable_t *vtable;
-  vfsnode_t *parent, *root, *sibling;
+  vfsnode_t *parent, *root, *sibling, *hash_link;
   vfs_dir_t *dirs;
   vfs_file_t *files;
   void *private;
+  int refs, dead;
+  unsigned long id;
+  vfsnode_t *limbo;
+  vfsnode_arena_t *arena;
   char name[];
 };
 
@@ -52,11 +58,14 @@ struct vfsnode_vtable_s
   void (*remove_child)(vfsnode_t *, vfsnode_t *);
   vfsnode_t *(*find)(vfsnode_t *, const char *, int *);
   int (*opendir)(vfsnode_t *, vfs_dir_t *, const char *);
-  vfs_dirent_t *(*readdir)(vfsnode_t *, vfs_dir_t *);
+  int (*readdir)(vfsnode_t *, vfs_dir_t *, vfs_dirent_t *, size_t);
   void (*closedir)(vfsnode_t *, vfs_dir_t *);
   int (*stat)(vfsnode_t *, const char *, vfs_stat_t *);
+  int (*fstat)(vfsnode_t *, vfs_file_t *, vfs_stat_t *);
   int (*open)(vfsnode_t *, vfs_file_t *, const char *, int);
   int (*read)(vfsnode_t *, vfs_file_t *, void *, size_t, size_t);
+  int (*map)(vfsnode_t *, vfs_file_t *, const void **, size_t);
+  int (*seek)(vfsnode_t *, vfs_file_t *, unsigned long);
   int (*eof)(vfsnode_t *, vfs_file_t *);
   int (*close)(vfsnode_t *, vfs_file_t *);
 };
@@ -77,17 +86,30 @@ struct vfs_file_s
   int eof;
   void *posp;
   unsigned long posn;
+  void (*notify)(void *);
+  void *notify_arg;
 };
 
 vfsnode_t *vfsnode_mknode(vfsnode_t *parent, const char *name, vfsnode_vtable_t *vtable, void *context);
 vfsnode_t *vfsnode_mkvirtnode(vfsnode_t *parent, const char *name);
+vfsnode_t *vfsnode_mksubtree(vfsnode_t *parent, const char *name);
 vfsnode_t *vfsnode_mkromnode(vfsnode_t *parent, const char *name,
 			     const void *data, size_t len);
+vfsnode_t *vfsnode_mktextnode(vfsnode_t *parent, const char *name,
+			      vfsnode_textgen_t gen);
 void vfsnode_destroy(vfsnode_t *node);
+void *vfsnode_alloc(vfsnode_t *node, size_t size);
+vfsnode_t *vfsnode_hold(vfs_file_t *file);
+void vfsnode_release(vfsnode_t *node);
 
 vfsnode_t *vfsnode_find(const char *path, int *offs);
+vfsnode_t *vfsnode_find_from(vfsnode_t *node, const char *path, int *offs);
+unsigned long vfsnode_generation(void);
+int vfsnode_epoch_enter(void);
+void vfsnode_epoch_leave(int epoch);
 
 vfs_dirent_t *vfsnode_readdir(vfs_dir_t *dir);
+int vfsnode_readdir_r(vfs_dir_t *dir, vfs_dirent_t *de, size_t size);
 vfs_dir_t *vfsnode_opendir(vfsnode_t *node, const char *path);
 int vfsnode_closedir(vfs_dir_t *dir);
 
@@ -95,7 +117,11 @@ int vfsnode_stat(vfsnode_t *node, const char *path, vfs_stat_t *st);
 
 vfs_file_t *vfsnode_open(vfsnode_t *node, const char *path, int write_mode);
 int vfsnode_read(void *buffer, size_t size, size_t nmemb, vfs_file_t *file);
+int vfsnode_map(const void **ptr, size_t len, vfs_file_t *file);
+int vfsnode_seek(vfs_file_t *file, unsigned long offset);
+int vfsnode_fstat(vfs_file_t *file, vfs_stat_t *st);
 int vfsnode_eof(vfs_file_t *file);
+void vfsnode_notify(vfs_file_t *file, void (*notify)(void *), void *arg);
 int vfsnode_close(vfs_file_t *file);
 
 